@@ -0,0 +1,83 @@
+/*!
+ * @file kp347-config.h
+ *
+ * Compile-time feature selection.  Every subsystem is on by default; set
+ * a macro to 0 (here, or with -D on the compiler command line) to leave
+ * that code and its RAM out of the build.  The prototypes of disabled
+ * features are hidden too, so a stray call fails at compile time rather
+ * than at link time.
+ */
+
+#ifndef KP347_CONFIG_H
+#define KP347_CONFIG_H
+
+#ifndef KP347_BARCODE
+#define KP347_BARCODE 1 //!< printBarcode(), setBarcodeHeight()
+#endif
+
+#ifndef KP347_BITMAP_STREAM
+#define KP347_BITMAP_STREAM 1 //!< printBitmapFromStream(), printBitmap()
+#endif
+
+#ifndef KP347_SLEEP
+#define KP347_SLEEP 1 //!< sleep(), sleepAfter()
+#endif
+
+#ifndef KP347_CHARSET
+#define KP347_CHARSET 1 //!< setCharset(), setCodePage()
+#endif
+
+#ifndef KP347_LEGACY_FIRMWARE
+#define KP347_LEGACY_FIRMWARE 1 //!< Paths for firmware older than 2.68
+#endif
+
+#ifndef KP347_WARM_START
+#define KP347_WARM_START 1 //!< Retained configuration, warm begin()
+#endif
+
+#ifndef KP347_AUTODETECT
+#define KP347_AUTODETECT 1 //!< detectFirmware(), begin(FIRMWARE_AUTO)
+#endif
+
+#ifndef KP347_CUTTER
+#define KP347_CUTTER 1 //!< cut(), printCopies() and cutter timing
+#endif
+
+#ifndef KP347_DRAFT
+#define KP347_DRAFT 1 //!< setDraftMode()
+#endif
+
+#ifndef KP347_COLUMN_BITMAPS
+#define KP347_COLUMN_BITMAPS 1 //!< printBitmapColumns()
+#endif
+
+#ifndef KP347_TABLE
+#define KP347_TABLE 1 //!< tableBegin(), tableRow()
+#endif
+
+#ifndef KP347_ASSETS
+#define KP347_ASSETS 1 //!< Asset bundles, PackBits bitmaps
+#endif
+
+#ifndef KP347_FANOUT
+#define KP347_FANOUT 1 //!< Job capture and fan-out to several printers
+#endif
+
+#ifndef KP347_PROBE
+#define KP347_PROBE 1 //!< probeBuffer(), tuneProfile()
+#endif
+
+#ifndef KP347_VIRTUAL
+#define KP347_VIRTUAL 1 //!< Virtual printer with scripted faults
+#endif
+
+#ifndef KP347_STATS
+#define KP347_STATS 1 //!< Printer counters, statsRead()
+#endif
+
+// Off by default: costs two cycle counter reads per region
+#ifndef KP347_CYCLES
+#define KP347_CYCLES 0 //!< Cycle counts of hot regions, cycleCounts()
+#endif
+
+#endif // KP347_CONFIG_H
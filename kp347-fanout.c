@@ -0,0 +1,133 @@
+/*!
+ * @file kp347-fanout.c
+ *
+ * Replays a captured job to several printers; see kp347-fanout.h.  The
+ * timing follows timeoutSet() and motionSet() in kp347-printer.c, with
+ * each printer's own profile and link speed.
+ */
+
+#include "kp347-fanout.h"
+
+#if KP347_FANOUT
+
+#define ASCII_GS 29 //!< Group separator
+
+// Record length before any data, by fanoutRecords type
+static const uint8_t recordSize[] = {3, 5, 5, 2};
+
+static uint16_t get16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+
+static uint32_t get32(const uint8_t *p) {
+  return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+void fanoutStart(struct fanoutPrinter *printers, uint8_t count,
+                 const uint8_t *job, size_t size) {
+  unsigned long now = micros();
+
+  for (uint8_t i = 0; i < count; i++) {
+    struct fanoutPrinter *p = &printers[i];
+    p->state = FANOUT_BUSY;
+    p->pos = job;
+    p->end = job + size;
+    p->sent = 0;
+    p->startTime = p->resumeTime = p->linkDone = now;
+    p->cutPending = false;
+  }
+}
+
+// Offers len bytes to the printer's link, counting their link time.
+// Returns false until all of them have been taken.
+static bool sendData(struct fanoutPrinter *p, const uint8_t *data,
+                     uint16_t len, unsigned long now) {
+  int n = p->send(p->context, data + p->sent, len - p->sent);
+
+  if (n < 0) {
+    p->state = FANOUT_FAILED;
+    return false;
+  }
+  if (KP347_TIME_DIFF(p->linkDone, now) < 0)
+    p->linkDone = now;
+  p->linkDone += n * p->byteTime;
+  p->sent += n;
+  if (p->sent < len)
+    return false;
+  p->sent = 0;
+  return true;
+}
+
+// Works through one printer's job until it has to wait.
+static void pumpOne(struct fanoutPrinter *p) {
+  unsigned long now, start;
+  const uint8_t *r;
+
+  while (p->state == FANOUT_BUSY) {
+    now = micros();
+    if (KP347_TIME_DIFF(now, p->resumeTime) < 0)
+      return;
+    if (p->pos >= p->end) {
+      p->state = FANOUT_DONE;
+      // Not now: the pump may come late
+      p->doneTime = (KP347_TIME_DIFF(p->linkDone, p->resumeTime) > 0)
+                        ? p->linkDone
+                        : p->resumeTime;
+      if (p->cutPending && (KP347_TIME_DIFF(p->cutDoneTime, p->doneTime) > 0))
+        p->doneTime = p->cutDoneTime; // Ends with a cut still running
+      return;
+    }
+
+    r = p->pos;
+    if ((r[0] >= sizeof(recordSize)) || (p->end - r < recordSize[r[0]]) ||
+        ((r[0] == FANOUT_DATA) && (p->end - r - 3 < get16(r + 1)))) {
+      p->state = FANOUT_FAILED; // Damaged or truncated job
+      return;
+    }
+    start = (KP347_TIME_DIFF(p->linkDone, now) > 0) ? p->linkDone : now;
+    switch (r[0]) {
+    case FANOUT_DATA:
+      if (!sendData(p, r + 3, get16(r + 1), now))
+        return;
+      p->pos += 3 + get16(r + 1);
+      break;
+    case FANOUT_WAIT: // Like timeoutSet(): counts from when the bytes are out
+      p->resumeTime = start + get32(r + 1);
+      p->pos += 5;
+      break;
+    case FANOUT_MOTION:
+      if (p->cutPending) {
+        if (KP347_TIME_DIFF(p->cutDoneTime, start) > 0)
+          start = p->cutDoneTime;
+        p->cutPending = false;
+      }
+      p->resumeTime = start + get16(r + 1) * p->profile->dotPrintTime +
+                      get16(r + 3) * p->profile->dotFeedTime;
+      p->pos += 5;
+      break;
+    case FANOUT_CUT: {
+      uint8_t cmd[4] = {ASCII_GS, 'V', r[1] ? 66 : 65,
+                        p->profile->cutterOffset};
+      if (!sendData(p, cmd, sizeof(cmd), now))
+        return;
+      p->cutDoneTime = start + p->profile->cutterOffset *
+                                   p->profile->dotFeedTime +
+                       p->profile->cutTime;
+      p->cutPending = true;
+      p->pos += 2;
+      break;
+    }
+    }
+  }
+}
+
+bool fanoutPump(struct fanoutPrinter *printers, uint8_t count) {
+  bool busy = false;
+
+  for (uint8_t i = 0; i < count; i++) {
+    pumpOne(&printers[i]);
+    if (printers[i].state == FANOUT_BUSY)
+      busy = true;
+  }
+  return busy;
+}
+
+#endif // KP347_FANOUT
@@ -0,0 +1,85 @@
+/*!
+ * @file kp347-fanout.h
+ *
+ * Sends one captured job (captureBegin() / captureEnd()) to several
+ * printers, e.g. the same order ticket to kitchen, bar and expo.  The job
+ * is encoded once and only read here, so all printers share it; each
+ * printer has its own link, timing profile, progress and state.
+ *
+ * fanoutPump() never waits: each call sends every printer as much as
+ * its own pacing allows and returns.  A printer whose link fails, or
+ * takes no bytes, holds up nobody else.  Since the command bytes are
+ * shared, the printers should run the same firmware generation; timing
+ * and the cutter offset come from each printer's profile.
+ */
+
+#ifndef KP347_FANOUT_H
+#define KP347_FANOUT_H
+
+#include "kp347-printer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*!
+ * State of one printer in a fan-out
+ */
+enum fanoutStates {
+  FANOUT_IDLE,   /**< No job started */
+  FANOUT_BUSY,   /**< Job in progress */
+  FANOUT_DONE,   /**< Whole job sent; the printer may still be printing */
+  FANOUT_FAILED, /**< Link failed or job damaged; the rest was dropped */
+};
+
+/*!
+ * One printer of a fan-out.  Set the fields up to context; the rest is
+ * state kept by fanoutStart() and fanoutPump().
+ */
+struct fanoutPrinter {
+  const struct printerProfile *profile; /**< Timing and cutter offset */
+  unsigned long byteTime; /**< Link time per byte, in microseconds */
+  /**
+   * Link output.  Must not block: returns how many of the len bytes were
+   * taken (the rest are offered again on the next pump), or -1 if the
+   * link failed.
+   */
+  int (*send)(void *context, const uint8_t *data, uint16_t len);
+  void *context; /**< Passed to send */
+
+  uint8_t state;          /**< Value from fanoutStates */
+  const uint8_t *pos;     /**< Next record to send */
+  const uint8_t *end;     /**< End of the job */
+  uint16_t sent;          /**< Bytes of the current data record already sent */
+  unsigned long startTime; /**< micros() at fanoutStart() */
+  unsigned long doneTime;  /**< Once FANOUT_DONE: when the printer is expected
+                                to have printed the job; doneTime - startTime
+                                is the job's time on this printer */
+  unsigned long resumeTime, linkDone, cutDoneTime;
+  bool cutPending;
+};
+
+#if KP347_FANOUT
+/*!
+  * @brief Starts sending a job to every printer
+  * @param printers Printers, set up as described in struct fanoutPrinter
+  * @param count Number of printers
+  * @param job Job from captureBegin(); must stay valid until all are done
+  * @param size Job length returned by captureEnd()
+  */
+void fanoutStart(struct fanoutPrinter *printers, uint8_t count,
+                 const uint8_t *job, size_t size);
+/*!
+  * @brief Sends each printer whatever its pacing allows; call repeatedly
+  * @param printers Printers passed to fanoutStart()
+  * @param count Number of printers
+  * @return Returns true while any printer is still FANOUT_BUSY
+  */
+bool fanoutPump(struct fanoutPrinter *printers, uint8_t count);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // KP347_FANOUT_H
@@ -35,8 +35,25 @@
 // operation, a few rare specimens instead work at 9600.  If so, change
 // this constant.  This will NOT make printing slower!  The physical
 // print and feed mechanisms are the bottleneck, not the port speed.
+// A port may define it instead; port-linux.h uses the speed of the link
+// actually opened.
+#ifndef BAUDRATE
 #define BAUDRATE                                                               \
   19200 //!< How many bits per second the serial port should transfer
+#endif
+
+// Longest gap allowed in bitmap data from the host stream before the rest
+// of the image is given up on, in microseconds.
+#define STREAM_TIMEOUT 1000000L
+// Most bytes the library sends after a single timeoutWait(); send-ahead
+// keeps this much of the printer's input buffer free.
+#define SEND_AHEAD_SLACK 128
+#define PROBE_STEP 32      // Resolution of probeBuffer(), in bytes
+#define PROBE_MIN_ROWS 64  // Least feeding that keeps a probe trial busy
+#define TUNE_FEED_ROWS 120 // Rows fed to time dotFeedTime
+#define TUNE_BAND_ROWS 24  // Solid raster rows to time dotPrintTime
+#define TUNE_LINES 4       // Text lines per tuneProfile() sample
+#define TUNE_LINE_CHARS 24 // Characters per sample line
 
 // ASCII codes used by some of the printer config commands:
 #define ASCII_TAB '\t' //!< Horizontal tab
@@ -66,6 +83,20 @@
  */
 #define BYTE_TIME (((11L * 1000000L) + (BAUDRATE / 2)) / BAUDRATE)
 
+// True if the printer needs the workaround for firmware older than fw.
+// Constant false without KP347_LEGACY_FIRMWARE, so the old paths drop out.
+#define LEGACY(fw) (KP347_LEGACY_FIRMWARE && (firmware < (fw)))
+
+// Print mode bits used with ESC ! n
+#define FONT_MASK (1 << 0) //!< Select character font A or B
+#define INVERSE_MASK                                                           \
+  (1 << 1) //!< Turn on/off white/black reverse printing mode. Not in 2.6.8
+           //!< firmware (see inverseOn())
+#define UPDOWN_MASK (1 << 2)        //!< Turn on/off upside-down printing mode
+#define BOLD_MASK (1 << 3)          //!< Turn on/off bold printing mode
+#define DOUBLE_HEIGHT_MASK (1 << 4) //!< Turn on/off double-height printing mode
+#define DOUBLE_WIDTH_MASK (1 << 5)  //!< Turn on/off double-width printing mode
+#define STRIKE_MASK (1 << 6)        //!< Turn on/off deleteline mode
 
 // Internal function
 static uint8_t printMode,
@@ -73,7 +104,9 @@ static uint8_t printMode,
           column,        // Last horizontal column printed
           maxColumn,     // Page width (output 'wraps' at this point)
           charHeight,    // Height of characters, in 'dots'
+          charWidth,     // Width of characters, in 'dots'
           lineSpacing,   // Inter-line spacing (not line height); in dots
+          lineInk,       // Bottom dot rows of the current line with ink
           barcodeHeight, // Barcode height in dots, not including text
           maxChunkHeight,
           dtrPin;         // DTR handshaking pin (experimental)
@@ -81,6 +114,25 @@ static uint16_t firmware;  // Firmware version
 static unsigned long  resumeTime,   // Wait until micros() exceeds this before sending byte
                       dotPrintTime, // Time to print a single dot line, in microseconds
                       dotFeedTime;  // Time to feed a single dot line, in microseconds
+static uint8_t modeCost[MODE_COSTS]; // Extra text print time by mode, percent
+static uint16_t bufferSize, // Printer input buffer to send ahead into, bytes
+                aheadBytes; // Bytes sent since the printer was last idle
+#if KP347_CUTTER
+static unsigned long cutTime,     // Time for the cutter to cut, in microseconds
+                     cutDoneTime; // When the cut in progress will be done
+static uint8_t cutterOffset; // Dot rows from print head to cutter
+#endif
+// Single-bit state, packed
+static struct {
+  uint8_t columnBitmaps : 1, // Print memory bitmaps in ESC * column format
+          cutPending : 1,    // cutDoneTime not yet accounted for
+          warmStart : 1,     // begin() found the configuration intact
+          draftMode : 1,     // Print every second bitmap row, feed the others
+          bitmapProgMem : 1, // bitmapPtr is in PROGMEM
+          streamFailed : 1,  // Byte source gave up; stop after this chunk
+          packLiteral : 1,   // Current PackBits run is literal
+          captureFull : 1;   // Capture buffer overflowed
+} flags;
 static void writeBytes(uint8_t a); 
 static void writeDoubleBytes(uint8_t a, uint8_t b);
 static void writeTripleBytes(uint8_t a, uint8_t b, uint8_t c);
@@ -90,17 +142,320 @@ static void unsetPrintMode(uint8_t mask);
 static void writePrintMode(); 
 static void adjustCharValues(uint8_t printMode);
 
+#if !KP347_WARM_START
+#undef KP347_RETAINED
+#endif
+#ifndef KP347_RETAINED
+#define KP347_RETAINED
+#endif
+
+// Configuration the printer currently holds, as last sent to it.  This
+// lives in retained RAM with a fingerprint, so after an MCU reset begin()
+// can tell whether the printer still holds what it would otherwise be
+// sent and skip the init sequence.  (A printer power cycle on its own is
+// not detected -- the status query only proves the printer is awake.)
+static struct printerConfig {
+  uint32_t fingerprint; // FNV-1a of everything below
+  uint16_t firmware;
+  uint16_t sleepTime;   // Auto-sleep delay in seconds, 0 = off
+  uint8_t heatDots, heatTime, heatInterval,
+          density,      // DC2 # argument
+          charset, codePage, lineHeight, barcodeHeight, printMode,
+          justify, underline, inverse, upsideDown, online, dtr,
+          reserved;     // Keeps the struct free of padding
+} config KP347_RETAINED;
+
+static uint32_t configHash() {
+  const uint8_t *p = (const uint8_t *)&config + sizeof(config.fingerprint);
+  uint32_t hash = 2166136261UL;
+  for (size_t i = sizeof(config.fingerprint); i < sizeof(config); i++) {
+    hash ^= *p++;
+    hash *= 16777619UL;
+  }
+  return hash;
+}
+
+// Call after every command that changes the printer's configuration.
+static void configSave() { config.fingerprint = configHash(); }
+
+static bool configValid() { return config.fingerprint == configHash(); }
+
+#if KP347_FANOUT
+// Job capture (see captureBegin()).  While buf is set, output goes into
+// records in buf instead of to the printer, and nothing waits.
+static struct {
+  uint8_t *buf;
+  size_t size, len;
+  size_t data; // Offset of the open data record's length field, 0 if none
+} capture;
+
+static bool captureRoom(size_t n) {
+  if (capture.len + n > capture.size)
+    flags.captureFull = true;
+  return !flags.captureFull;
+}
+
+static void captureClose() {
+  if (capture.data) {
+    size_t n = capture.len - capture.data - 2;
+    capture.buf[capture.data] = n;
+    capture.buf[capture.data + 1] = n >> 8;
+    capture.data = 0;
+  }
+}
+
+static void captureByte(uint8_t c) {
+  if (capture.data && (capture.len - capture.data - 2 == 0xFFFF))
+    captureClose();
+  if (!capture.data) {
+    if (!captureRoom(3))
+      return;
+    capture.buf[capture.len++] = FANOUT_DATA;
+    capture.data = capture.len;
+    capture.len += 2;
+  }
+  if (captureRoom(1))
+    capture.buf[capture.len++] = c;
+}
+
+// Closes the data record and appends a mark with an n-byte value.
+static void captureMark(uint8_t type, uint8_t n, uint32_t value) {
+  captureClose();
+  if (!captureRoom(1 + n))
+    return;
+  capture.buf[capture.len++] = type;
+  for (; n > 0; n--, value >>= 8)
+    capture.buf[capture.len++] = value; // Little-endian
+}
+
+void captureBegin(uint8_t *buf, size_t size) {
+  capture.buf = buf;
+  capture.size = size;
+  capture.len = 0;
+  capture.data = 0;
+  flags.captureFull = false;
+}
+
+size_t captureEnd() {
+  captureClose();
+  capture.buf = NULL;
+  return flags.captureFull ? 0 : capture.len;
+}
+#endif
+
+#if KP347_CYCLES
+static struct cycleCount cycles[CYCLE_REGIONS];
+static uint8_t cycleRegion = CYCLE_REGIONS; // Running now, CYCLE_REGIONS = none
+static unsigned long cycleMark;             // Counter when it started running
+
+// Charges the cycles since the last switch to the region that was running
+// and makes r the running one.  Returns the region switched from.
+static uint8_t cycleSwitch(uint8_t r) {
+  unsigned long now = KP347_CYCLE_COUNTER();
+  uint8_t prev = cycleRegion;
+
+  if (prev < CYCLE_REGIONS)
+    cycles[prev].cycles += now - cycleMark;
+  cycleMark = now;
+  cycleRegion = r;
+  return prev;
+}
+
+static uint8_t cycleEnter(uint8_t r) {
+  cycles[r].calls++;
+  return cycleSwitch(r);
+}
+
+const struct cycleCount *cycleCounts() {
+  cycleSwitch(cycleRegion); // Bring the running region up to date
+  return cycles;
+}
+
+void cycleCountsReset() { memset(cycles, 0, sizeof(cycles)); }
+
+#define CYCLES_ENTER(r) uint8_t cyclesPrev = cycleEnter(r)
+#define CYCLES_LEAVE() cycleSwitch(cyclesPrev)
+#else
+#define CYCLES_ENTER(r)
+#define CYCLES_LEAVE()
+#endif
+
+#if KP347_STATS
+// Counters for statsRead(), written by the printing thread only.  Updates
+// of more than one counter are bracketed by statsSeq going odd and back
+// to even (a sequence lock), so a reader on another thread copies them
+// between two equal even values and never makes the writer wait.
+static struct printerStats stats;
+static uint32_t statsSeq;
+static uint32_t statusMissed; // Queries lost since the printer last answered
+
+static void statsOpen() {
+  __atomic_store_n(&statsSeq, statsSeq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void statsClose() {
+  __atomic_store_n(&statsSeq, statsSeq + 1, __ATOMIC_RELEASE);
+}
+
+static void statsWait(unsigned long us) {
+  unsigned long limit = 1000; // 1 ms, times 4 per bucket
+  uint8_t b;
+
+  for (b = 0; (b < STATS_WAIT_BUCKETS - 1) && (us > limit); b++)
+    limit *= 4;
+  statsOpen();
+  stats.waits++;
+  stats.waitMicros += us;
+  stats.waitBuckets[b]++;
+  statsClose();
+}
+
+static void statsPaper(bool out) {
+  if (out == stats.paperOut)
+    return;
+  statsOpen();
+  if (out)
+    stats.paperOuts++;
+  else
+    stats.recoveries++;
+  stats.paperOut = out;
+  statsClose();
+}
+
+void statsRead(struct printerStats *out) {
+  uint32_t seq;
+
+  do {
+    seq = __atomic_load_n(&statsSeq, __ATOMIC_ACQUIRE);
+    memcpy(out, &stats, sizeof(*out));
+    out->aheadBytes = __atomic_load_n(&aheadBytes, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while ((seq & 1) || (seq != __atomic_load_n(&statsSeq, __ATOMIC_RELAXED)));
+}
+
+void statsReset() {
+  statsOpen();
+  memset(&stats, 0, sizeof(stats));
+  statusMissed = 0;
+  statsClose();
+}
+
+// A single counter needs no bracket: it is one aligned store
+#define STATS_ADD(field, n)                                                    \
+  __atomic_store_n(&stats.field, stats.field + (n), __ATOMIC_RELAXED)
+#define STATS_WAIT_START() unsigned long statsStart = micros()
+#define STATS_WAIT_END() statsWait(KP347_TIME_DIFF(micros(), statsStart))
+#else
+#define STATS_ADD(field, n) (void)0
+#define STATS_WAIT_START()
+#define STATS_WAIT_END()
+#endif
+
+// All printer output goes through here.
+static void sendByte(uint8_t c) {
+#if KP347_FANOUT
+  if (capture.buf) {
+    captureByte(c);
+    return;
+  }
+#endif
+  CYCLES_ENTER(CYCLES_SEND);
+  aheadBytes++;
+  STATS_ADD(bytesSent, 1);
+  KP347_SEND_BYTE(c);
+  CYCLES_LEAVE();
+}
+
+// When a just-issued task starts: now, unless bytes were sent ahead while
+// the printer was busy, in which case it queues behind the prior task.
+static unsigned long taskStart() {
+  unsigned long now = micros();
+
+  if (bufferSize && (KP347_TIME_DIFF(resumeTime, now) > 0))
+    return resumeTime;
+  return now;
+}
+
 // This method sets the estimated completion time for a just-issued task.
 void timeoutSet(unsigned long x) {
-    resumeTime = micros() + x;
+#if KP347_FANOUT
+  if (capture.buf) {
+    captureMark(FANOUT_WAIT, 4, x);
+    return;
+  }
+#endif
+    KP347_FLUSH(); // The task starts once its bytes are out
+    resumeTime = taskStart() + x;
+}
+
+// Link time of n bytes just sent.  Not captured: each fan-out printer
+// works it out from the data and its own link speed.
+static void linkSet(uint8_t n) {
+#if KP347_FANOUT
+  if (capture.buf)
+    return;
+#endif
+  timeoutSet(n * BYTE_TIME);
+}
+
+// Same as timeoutSet(), for tasks that need the print mechanism: bytes
+// just sent, then printRows dot rows printed and feedRows fed.  A cut
+// keeps the mechanism busy for a while, but the printer still accepts
+// bytes meanwhile, so cut() doesn't hold off the next bytes.  Instead the
+// first mechanical task after it is scheduled to start once the cutter
+// is done.
+static void motionSet(unsigned long bytes, unsigned long printRows,
+                      unsigned long feedRows) {
+  unsigned long start;
+
+#if KP347_FANOUT
+  if (capture.buf) {
+    captureMark(FANOUT_MOTION, 4, printRows | (feedRows << 16));
+    return;
+  }
+#endif
+  KP347_FLUSH();
+  start = taskStart();
+#if KP347_CUTTER
+  if (flags.cutPending) {
+    if (KP347_TIME_DIFF(cutDoneTime, start) > 0)
+      start = cutDoneTime;
+    flags.cutPending = false;
+  }
+#endif
+  resumeTime = start + bytes * BYTE_TIME + printRows * dotPrintTime +
+               feedRows * dotFeedTime;
 }
 
 // This function waits (if necessary) for the prior task to complete.
+// With a buffer size from the profile, bytes are sent ahead into the
+// printer's input buffer instead, as long as it has room for them.
 void timeoutWait() {
-
-    while ((long)(micros() - resumeTime) < 0L) {
+#if KP347_FANOUT
+  if (capture.buf)
+    return; // Paced later, per printer
+#endif
+  if (KP347_TIME_DIFF(micros(), resumeTime) < 0) {
+    if (aheadBytes + SEND_AHEAD_SLACK <= bufferSize)
+      return;
+    CYCLES_ENTER(CYCLES_WAIT);
+    STATS_WAIT_START();
+    while (KP347_TIME_DIFF(micros(), resumeTime) < 0) {
       yield();
     }; // (syntax is rollover-proof)
+    STATS_WAIT_END();
+    CYCLES_LEAVE();
+  }
+  aheadBytes = 0; // Printer idle, buffer empty
+}
+
+// Time left until the prior task completes, for callers that would rather
+// do something else than sit in timeoutWait().
+unsigned long timeoutRemaining() {
+  long left = KP347_TIME_DIFF(resumeTime, micros());
+
+  return (left > 0L) ? (unsigned long)left : 0;
 }
 
 // Printer performance may vary based on the power supply voltage,
@@ -124,32 +479,154 @@ void setTimes(unsigned long p, unsigned long f) {
 
 void writeBytes(uint8_t a) {
   timeoutWait();
-  KP347_SEND_BYTE(a);
-  timeoutSet(BYTE_TIME);
+  sendByte(a);
+  linkSet(1);
 }
 
 void writeDoubleBytes(uint8_t a, uint8_t b) {
   timeoutWait();
-  KP347_SEND_BYTE(a);
-  KP347_SEND_BYTE(b);
-  timeoutSet(2 * BYTE_TIME);
+  sendByte(a);
+  sendByte(b);
+  linkSet(2);
 }
 
 void writeTripleBytes(uint8_t a, uint8_t b, uint8_t c) {
   timeoutWait();
-  KP347_SEND_BYTE(a);
-  KP347_SEND_BYTE(b);
-  KP347_SEND_BYTE(c);
-  timeoutSet(3 * BYTE_TIME);
+  sendByte(a);
+  sendByte(b);
+  sendByte(c);
+  linkSet(3);
 }
 
 void writeQuadBytes(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
   timeoutWait();
-  KP347_SEND_BYTE(a);
-  KP347_SEND_BYTE(b);
-  KP347_SEND_BYTE(c);
-  KP347_SEND_BYTE(d);
-  timeoutSet(4 * BYTE_TIME);
+  sendByte(a);
+  sendByte(b);
+  sendByte(c);
+  sendByte(d);
+  linkSet(4);
+}
+
+// Most configuration commands are a prefix, a command byte and one
+// argument, differing only in range, firmware quirks and which shadow
+// field they change.  They are described here and issued by
+// sendCommand(), rather than each setter hand-coding the bytes.
+#define CMD_WORD (1 << 0) //!< 16-bit argument; one byte before cmd->firmware
+#define CMD_MODE (1 << 1) //!< Before cmd->firmware, toggles print mode bit mask
+#define CMD_FEED (1 << 2) //!< Argument is dot rows fed
+#define NO_SHADOW 0xFF    //!< Command not recorded in the configuration
+
+#define SHADOW(field) offsetof(struct printerConfig, field)
+
+enum {
+  CMD_BARCODE_HEIGHT,
+  CMD_CHAR_SPACING,
+  CMD_CHARSET,
+  CMD_CODE_PAGE,
+  CMD_DENSITY,
+  CMD_FEED_ROWS,
+  CMD_INVERSE,
+  CMD_JUSTIFY,
+  CMD_LINE_HEIGHT,
+  CMD_ONLINE,
+  CMD_PRINT_MODE,
+  CMD_SLEEP,
+  CMD_UNDERLINE,
+  CMD_UPSIDE_DOWN,
+};
+
+static const struct command {
+  uint8_t prefix, code; // Command bytes
+  uint8_t min, max;     // Argument range (ignored for CMD_WORD)
+  uint16_t firmware;    // Firmware the standard form needs
+  uint8_t flags;        // CMD_* flags
+  uint8_t mask;         // Print mode bit for CMD_MODE
+  uint8_t shadow;       // Offset of the configuration field, or NO_SHADOW
+} commands[] = {
+    [CMD_BARCODE_HEIGHT] = {ASCII_GS, 'h', 1, 255, 0, 0, 0,
+                            SHADOW(barcodeHeight)},
+    [CMD_CHAR_SPACING] = {ASCII_ESC, ' ', 0, 255, 0, 0, 0, NO_SHADOW},
+    [CMD_CHARSET] = {ASCII_ESC, 'R', 0, 15, 0, 0, 0, SHADOW(charset)},
+    [CMD_CODE_PAGE] = {ASCII_ESC, 't', 0, 47, 0, 0, 0, SHADOW(codePage)},
+    [CMD_DENSITY] = {ASCII_DC2, '#', 0, 255, 0, 0, 0, SHADOW(density)},
+    [CMD_FEED_ROWS] = {ASCII_ESC, 'J', 0, 255, 0, CMD_FEED, 0, NO_SHADOW},
+    [CMD_INVERSE] = {ASCII_GS, 'B', 0, 1, 268, CMD_MODE, INVERSE_MASK,
+                     SHADOW(inverse)},
+    [CMD_JUSTIFY] = {ASCII_ESC, 'a', 0, 2, 0, 0, 0, SHADOW(justify)},
+    [CMD_LINE_HEIGHT] = {ASCII_ESC, '3', 24, 255, 0, 0, 0,
+                         SHADOW(lineHeight)},
+    [CMD_ONLINE] = {ASCII_ESC, '=', 0, 1, 0, 0, 0, SHADOW(online)},
+    [CMD_PRINT_MODE] = {ASCII_ESC, '!', 0, 255, 0, 0, 0, SHADOW(printMode)},
+    [CMD_SLEEP] = {ASCII_ESC, '8', 0, 0, 264, CMD_WORD, 0, SHADOW(sleepTime)},
+    [CMD_UNDERLINE] = {ASCII_ESC, '-', 0, 2, 0, 0, 0, SHADOW(underline)},
+    [CMD_UPSIDE_DOWN] = {ASCII_ESC, '{', 0, 1, 268, CMD_MODE, UPDOWN_MASK,
+                         SHADOW(upsideDown)},
+};
+
+static void sendCommand(uint8_t id, long arg) {
+  const struct command *cmd = &commands[id];
+
+  if (cmd->flags & CMD_WORD) {
+    if (arg < 0)
+      arg = 0;
+    else if (arg > 0xFFFF)
+      arg = 0xFFFF;
+  } else if (arg < cmd->min) {
+    arg = cmd->min;
+  } else if (arg > cmd->max) {
+    arg = cmd->max;
+  }
+
+  if (LEGACY(cmd->firmware)) {
+    if (cmd->flags & CMD_MODE) {
+      // Older firmware only has this as a print mode bit
+      if (arg)
+        setPrintMode(cmd->mask);
+      else
+        unsetPrintMode(cmd->mask);
+      return;
+    }
+    writeTripleBytes(cmd->prefix, cmd->code, arg);
+  } else if (cmd->flags & CMD_WORD) {
+    writeQuadBytes(cmd->prefix, cmd->code, arg, arg >> 8);
+  } else {
+    writeTripleBytes(cmd->prefix, cmd->code, arg);
+  }
+
+  if (cmd->flags & CMD_FEED) {
+    motionSet(0, 0, arg);
+    prevByte = '\n';
+    column = 0;
+  }
+  if (cmd->shadow != NO_SHADOW) {
+    uint8_t *shadow = (uint8_t *)&config + cmd->shadow;
+    if (cmd->flags & CMD_WORD) {
+      shadow[0] = arg; // Little-endian, like the targets
+      shadow[1] = arg >> 8;
+    } else {
+      *shadow = arg;
+    }
+    configSave();
+  }
+}
+
+// Dot rows of print time for a text line with ink rows of ink, from the
+// modes in effect.  Justified and upside-down lines are buffered whole
+// before printing; inverse and double height heat more dots per row.
+static unsigned long textRows(uint8_t ink) {
+  unsigned long percent = 100;
+
+  if (!ink)
+    return 0;
+  if (config.justify)
+    percent += modeCost[MODE_COST_JUSTIFY];
+  if (config.upsideDown || (printMode & UPDOWN_MASK))
+    percent += modeCost[MODE_COST_UPSIDE_DOWN];
+  if (config.inverse || (printMode & INVERSE_MASK))
+    percent += modeCost[MODE_COST_INVERSE];
+  if (printMode & DOUBLE_HEIGHT_MASK)
+    percent += modeCost[MODE_COST_DOUBLE_HEIGHT];
+  return (ink * percent + 50) / 100;
 }
 
 // The underlying method for all high-level printing (e.g. println()).
@@ -158,46 +635,226 @@ size_t write(uint8_t c) {
 
   if (c != 13) { // Strip carriage returns
     timeoutWait();
-    KP347_SEND_BYTE(c);
-    unsigned long d = BYTE_TIME;
+    sendByte(c);
+    // Only rows with ink cost print time; the rest of the line is fed.  A
+    // space leaves no ink unless it is inverse (a full black cell) or
+    // underlined (just the underline rows).
+    if (c != '\n') {
+      if ((c != ' ') || config.inverse || (printMode & INVERSE_MASK))
+        lineInk = 255;
+      else if (config.underline > lineInk)
+        lineInk = config.underline;
+    }
     if ((c == '\n') || (column == maxColumn)) { // If newline or wrap
-      d += (prevByte == '\n') ? ((charHeight + lineSpacing) * dotFeedTime)
-                              : // Feed line
-               ((charHeight * dotPrintTime) +
-                (lineSpacing * dotFeedTime)); // Text line
+      uint8_t ink = (prevByte == '\n') ? 0 : lineInk;
+      if (ink > charHeight)
+        ink = charHeight;
+      motionSet(1, textRows(ink), charHeight - ink + lineSpacing);
+      lineInk = 0;
       column = 0;
       c = '\n'; // Treat wrap as newline on next pass
     } else {
       column++;
+      linkSet(1);
     }
-    timeoutSet(d);
     prevByte = c;
   }
 
   return 1;
 }
 
+// Status queries in two halves, so a caller with its own event loop can
+// wait for the reply there.  statusRequest() drops any stale reply first.
+void statusRequest() {
+  while (KP347_IS_AVAILABLE())
+    KP347_RECEIVE(); // Drop stale replies
+
+  if (!LEGACY(264)) {
+    writeTripleBytes(ASCII_ESC, 'v', 0);
+  } else {
+    writeTripleBytes(ASCII_GS, 'r', 0);
+  }
+  STATS_ADD(statusQueries, 1);
+}
+
+int statusPoll() {
+  int status = KP347_IS_AVAILABLE() ? KP347_RECEIVE() : -1;
+
+#if KP347_STATS
+  if (status >= 0) {
+    statsPaper(status & STATUS_PAPER_OUT);
+    // Still there, so what it didn't answer was lost in its input buffer
+    if (statusMissed) {
+      STATS_ADD(overruns, statusMissed);
+      statusMissed = 0;
+    }
+  }
+#endif
+  return status;
+}
+
+// Issue a paper status query and wait up to tries * wait ms for the
+// reply.  Returns the status byte, or -1 if the printer didn't answer.
+static int readStatus(uint8_t tries, unsigned long wait) {
+  statusRequest();
+
+  for (uint8_t i = 0; i < tries; i++) {
+    int status = statusPoll();
+    if (status >= 0)
+      return status;
+    delay(wait);
+  }
+  STATS_ADD(statusLost, 1);
+#if KP347_STATS
+  statusMissed++;
+#endif
+  return -1;
+}
+
+// Timing profiles by firmware version, lowest version first.  Add an
+// entry here once a firmware revision has been measured; begin() picks
+// the last entry not newer than the printer.
+static const struct printerProfile profiles[] = {
+    // See comments near top of file for the print and feed times.  The
+    // cut time is a conservative guess; see measureCutTime().  Mode costs
+    // are uncalibrated, i.e. the print times already cover every mode.
+    // No send-ahead until the buffer has been measured (probeBuffer()).
+    {0, 30000, 2100, 96, 500000L, false, {0, 0, 0, 0}, 0},
+};
+
+void setProfile(const struct printerProfile *profile) {
+  dotPrintTime = profile->dotPrintTime;
+  dotFeedTime = profile->dotFeedTime;
+#if KP347_CUTTER
+  cutterOffset = profile->cutterOffset;
+  cutTime = profile->cutTime;
+#endif
+  flags.columnBitmaps = KP347_COLUMN_BITMAPS && profile->columnBitmaps;
+  memcpy(modeCost, profile->modeCost, sizeof(modeCost));
+  bufferSize = profile->bufferSize;
+}
+
+void setModeCost(uint8_t mode, uint8_t percent) {
+  if (mode < MODE_COSTS)
+    modeCost[mode] = percent;
+}
+
+#if KP347_AUTODETECT || KP347_CUTTER || KP347_PROBE
+// Wait up to timeout microseconds for a byte from the printer.
+static int readByte(unsigned long timeout) {
+  unsigned long start = micros();
+  while (!KP347_IS_AVAILABLE()) {
+    if (KP347_TIME_DIFF(micros(), start) >= (long)timeout)
+      return -1;
+    yield();
+  }
+  return KP347_RECEIVE();
+}
+#endif
+
+#if KP347_AUTODETECT
+// GS I 65 returns the firmware version as '_' followed by a NUL-terminated
+// string such as "2.69" or "V2.6.8"; the first three digits make the
+// version number.  Printers without GS I simply don't answer.
+uint16_t detectFirmware() {
+  uint16_t version = 0;
+  uint8_t digits = 0;
+  int c;
+
+  while (KP347_IS_AVAILABLE())
+    KP347_RECEIVE(); // Drop stale replies
+
+  writeTripleBytes(ASCII_GS, 'I', 65);
+  if (readByte(100000L) != '_')
+    return 0;
+  while ((c = readByte(10000L)) > 0) { // Up to the NUL terminator
+    if ((c >= '0') && (c <= '9') && (digits < 3)) {
+      version = version * 10 + (c - '0');
+      digits++;
+    }
+  }
+  return (digits == 3) ? version : 0;
+}
+#endif
+
 void begin(uint16_t version) {
+  bool awake = false;
+  uint8_t i;
 
-  firmware = version;
+#if KP347_CYCLES
+  KP347_CYCLE_COUNTER_INIT();
+#endif
 
-  // The printer can't start receiving data immediately upon power up --
-  // it needs a moment to cold boot and initialize.  Allow at least 1/2
-  // sec of uptime before printer can receive data.
-  timeoutSet(500000L);
+#if KP347_AUTODETECT
+  if (version == FIRMWARE_AUTO) {
+    if (KP347_WARM_START && configValid() && config.firmware) {
+      version = config.firmware; // Detected on an earlier boot
+    } else {
+      // Wake the printer the old-firmware way, which all versions accept,
+      // so it can answer the query.
+      firmware = 0;
+      timeoutSet(500000L);
+      wake();
+      awake = true;
+      version = detectFirmware();
+      if (!version)
+        version = FIRMWARE_LEGACY;
+    }
+  }
+#endif
 
-  wake();
-  reset();
+  firmware = version;
+
+  // After an MCU reset the printer usually still holds everything begin()
+  // would send.  If the retained configuration says so and the printer
+  // answers a status query (i.e. it is powered and awake), just restore
+  // our side of the state.
+  if (KP347_WARM_START && configValid() && (config.firmware == version) &&
+      (config.sleepTime == 0) && (config.heatDots == 11) &&
+      (config.heatTime == 120) && (config.heatInterval == 40) &&
+      (config.dtr == (dtrPin < 255)) && (readStatus(5, 10) >= 0)) {
+    flags.warmStart = true;
+    printMode = config.printMode;
+    adjustCharValues(printMode);
+    lineSpacing = config.lineHeight - 24;
+    barcodeHeight = config.barcodeHeight;
+    prevByte = '\n';
+    column = 0;
+  } else {
+    flags.warmStart = false;
+    config.firmware = version;
+    config.dtr = 0;
+    configSave();
+
+    // The printer can't start receiving data immediately upon power up --
+    // it needs a moment to cold boot and initialize.  Allow at least 1/2
+    // sec of uptime before printer can receive data.  Detection already
+    // did that, and woke the printer the old-firmware way.
+    if (!awake) {
+      timeoutSet(500000L);
+      wake();
+    } else if (!LEGACY(264)) {
+      writeQuadBytes(ASCII_ESC, '8', 0, 0); // Sleep off, as wake() would
+      config.sleepTime = 0;
+      configSave();
+    }
+    reset();
 
-  setHeatConfig(11, 120, 40);
+    setHeatConfig(11, 120, 40);
 
-  // Enable DTR pin if requested
-  if (dtrPin < 255) {
-    writeTripleBytes(ASCII_GS, 'a', (1 << 5));
+    // Enable DTR pin if requested
+    if (dtrPin < 255) {
+      writeTripleBytes(ASCII_GS, 'a', (1 << 5));
+      config.dtr = 1;
+      configSave();
+    }
   }
 
-  dotPrintTime = 30000; // See comments near top of file for
-  dotFeedTime = 2100;   // an explanation of these values.
+  for (i = 1; i < sizeof(profiles) / sizeof(profiles[0]); i++) {
+    if (profiles[i].firmware > version)
+      break;
+  }
+  setProfile(&profiles[i - 1]);
   maxChunkHeight = 255;
 }
 
@@ -208,10 +865,24 @@ void reset() {
   column = 0;
   maxColumn = 32;
   charHeight = 24;
+  charWidth = 12;
   lineSpacing = 6;
   barcodeHeight = 50;
 
-  if (firmware >= 264) {
+  // ESC @ restores the text settings, but not heat or density
+  config.printMode = 0;
+  config.justify = 0;
+  config.underline = 0;
+  config.inverse = 0;
+  config.upsideDown = 0;
+  config.online = 1;
+  config.lineHeight = 30;
+  config.barcodeHeight = 50;
+  config.charset = 0;
+  config.codePage = 0;
+  configSave();
+
+  if (!LEGACY(264)) {
     // Configure tab stops on recent printers
     writeDoubleBytes(ASCII_ESC, 'D'); // Set tab stops...
     writeQuadBytes(4, 8, 12, 16);   // ...every 4 columns,
@@ -221,6 +892,18 @@ void reset() {
 
 // Reset text formatting parameters.
 void setDefault() {
+  // Nothing to send if a warm start left the printer in this state
+  if (flags.warmStart && (config.online == 1) && (config.justify == 0) &&
+      (config.inverse == 0) && (config.underline == 0) &&
+      !(config.printMode & (INVERSE_MASK | DOUBLE_HEIGHT_MASK |
+                            DOUBLE_WIDTH_MASK | BOLD_MASK)) &&
+      (config.lineHeight == 30) && (config.barcodeHeight == 50) &&
+      (config.charset == 0) && (config.codePage == 0)) {
+    flags.warmStart = false;
+    return;
+  }
+  flags.warmStart = false;
+
   online();
   justify('L');
   inverseOff();
@@ -228,10 +911,14 @@ void setDefault() {
   setLineHeight(30);
   boldOff();
   underlineOff();
+#if KP347_BARCODE
   setBarcodeHeight(50);
+#endif
   setSize('s');
+#if KP347_CHARSET
   setCharset(0);
   setCodePage(0);
+#endif
 }
 
 void test() {
@@ -241,26 +928,24 @@ void test() {
 
 void testPage() {
   writeDoubleBytes(ASCII_DC2, 'T');
-  timeoutSet(dotPrintTime * 24 * 26 + // 26 lines w/text (ea. 24 dots high)
-             dotFeedTime *
-                 (6 * 26 + 30)); // 26 text lines (feed 6 dots) + blank line
+  motionSet(0, 24 * 26,     // 26 lines w/text (ea. 24 dots high)
+            6 * 26 + 30); // 26 text lines (feed 6 dots) + blank line
 }
 
+#if KP347_BARCODE
 void setBarcodeHeight(uint8_t val) { // Default is 50
-  if (val < 1)
-    val = 1;
-  barcodeHeight = val;
-  writeTripleBytes(ASCII_GS, 'h', val);
+  sendCommand(CMD_BARCODE_HEIGHT, val);
+  barcodeHeight = config.barcodeHeight;
 }
 
 void printBarcode(const char *text, uint8_t type) {
   feed(1); // Recent firmware can't print barcode w/o feed first???
-  if (firmware >= 264)
+  if (!LEGACY(264))
     type += 65;
   writeTripleBytes(ASCII_GS, 'H', 2);    // Print label below barcode
   writeTripleBytes(ASCII_GS, 'w', 3);    // Barcode width 3 (0.375/1.0mm thin/thick)
   writeTripleBytes(ASCII_GS, 'k', type); // Barcode type (listed in .h file)
-  if (firmware >= 264) {
+  if (!LEGACY(264)) {
     int len = strlen(text);
     if (len > 255)
       len = 255;
@@ -273,23 +958,15 @@ void printBarcode(const char *text, uint8_t type) {
       writeBytes(c = text[i++]);
     } while (c);
   }
-  timeoutSet((barcodeHeight + 40) * dotPrintTime);
+  motionSet(0, barcodeHeight + 40, 0);
   prevByte = '\n';
 }
+#endif
 
 // === Character commands ===
-#define FONT_MASK (1 << 0) //!< Select character font A or B
-#define INVERSE_MASK                                                           \
-  (1 << 1) //!< Turn on/off white/black reverse printing mode. Not in 2.6.8
-           //!< firmware (see inverseOn())
-#define UPDOWN_MASK (1 << 2)        //!< Turn on/off upside-down printing mode
-#define BOLD_MASK (1 << 3)          //!< Turn on/off bold printing mode
-#define DOUBLE_HEIGHT_MASK (1 << 4) //!< Turn on/off double-height printing mode
-#define DOUBLE_WIDTH_MASK (1 << 5)  //!< Turn on/off double-width printing mode
-#define STRIKE_MASK (1 << 6)        //!< Turn on/off deleteline mode
 
 void adjustCharValues(uint8_t printMode) {
-  uint8_t charWidth;
+  CYCLES_ENTER(CYCLES_CHAR_VALUES);
   if (printMode & FONT_MASK) {
     // FontB
     charHeight = 17;
@@ -309,6 +986,7 @@ void adjustCharValues(uint8_t printMode) {
     charHeight *= 2;
   }
   maxColumn = (384 / charWidth);
+  CYCLES_LEAVE();
 }
 
 void setPrintMode(uint8_t mask) {
@@ -327,46 +1005,20 @@ void unsetPrintMode(uint8_t mask) {
   // maxColumn = (printMode & DOUBLE_WIDTH_MASK) ? 16 : 32;
 }
 
-void writePrintMode() {
-  writeTripleBytes(ASCII_ESC, '!', printMode);
-}
+void writePrintMode() { sendCommand(CMD_PRINT_MODE, printMode); }
 
 void normal() {
   printMode = 0;
   writePrintMode();
 }
 
-void inverseOn() {
-  if (firmware >= 268) {
-    writeTripleBytes(ASCII_GS, 'B', 1);
-  } else {
-    setPrintMode(INVERSE_MASK);
-  }
-}
+void inverseOn() { sendCommand(CMD_INVERSE, 1); }
 
-void inverseOff() {
-  if (firmware >= 268) {
-    writeTripleBytes(ASCII_GS, 'B', 0);
-  } else {
-    unsetPrintMode(INVERSE_MASK);
-  }
-}
+void inverseOff() { sendCommand(CMD_INVERSE, 0); }
 
-void upsideDownOn() {
-  if (firmware >= 268) {
-    writeTripleBytes(ASCII_ESC, '{', 1);
-  } else {
-    setPrintMode(UPDOWN_MASK);
-  }
-}
+void upsideDownOn() { sendCommand(CMD_UPSIDE_DOWN, 1); }
 
-void upsideDownOff() {
-  if (firmware >= 268) {
-    writeTripleBytes(ASCII_ESC, '{', 0);
-  } else {
-    unsetPrintMode(UPDOWN_MASK);
-  }
-}
+void upsideDownOff() { sendCommand(CMD_UPSIDE_DOWN, 0); }
 
 void doubleHeightOn() { setPrintMode(DOUBLE_HEIGHT_MASK); }
 
@@ -399,14 +1051,14 @@ void justify(char value) {
     break;
   }
 
-  writeTripleBytes(ASCII_ESC, 'a', pos);
+  sendCommand(CMD_JUSTIFY, pos);
 }
 
 // Feeds by the specified number of lines
 void feed(uint8_t x) {
-  if (firmware >= 264) {
+  if (!LEGACY(264)) {
     writeTripleBytes(ASCII_ESC, 'd', x);
-    timeoutSet(dotFeedTime * charHeight);
+    motionSet(0, 0, charHeight);
     prevByte = '\n';
     column = 0;
   } else {
@@ -416,13 +1068,60 @@ void feed(uint8_t x) {
 }
 
 // Feeds by the specified number of individual pixel rows
-void feedRows(uint8_t rows) {
-  writeTripleBytes(ASCII_ESC, 'J', rows);
-  timeoutSet(rows * dotFeedTime);
+void feedRows(uint8_t rows) { sendCommand(CMD_FEED_ROWS, rows); }
+
+#if KP347_CUTTER
+// GS V m n: feed n dots (the head-to-cutter distance, so the last line
+// clears the blade) and cut.  m = 65 for a full cut, 66 for partial.
+void cut(bool partial) {
+#if KP347_FANOUT
+  if (capture.buf) {
+    // Each fan-out printer issues the cut with its own cutter offset
+    captureMark(FANOUT_CUT, 1, partial);
+    prevByte = '\n';
+    column = 0;
+    return;
+  }
+#endif
+  writeQuadBytes(ASCII_GS, 'V', partial ? 66 : 65, cutterOffset);
+  cutDoneTime = taskStart() + cutterOffset * dotFeedTime + cutTime;
+  flags.cutPending = true;
   prevByte = '\n';
   column = 0;
 }
 
+void setCutTime(unsigned long t) { cutTime = t; }
+
+// Time a cut by following it with a status query, which the printer only
+// answers once it has worked through the cut.  Uses one cut of paper.
+unsigned long measureCutTime(bool partial) {
+  unsigned long start;
+
+  cut(partial);
+  flags.cutPending = false;
+  start = micros();
+  statusRequest();
+  if (readByte(5000000L) >= 0) {
+    start = KP347_TIME_DIFF(micros(), start) - 4 * BYTE_TIME -
+            cutterOffset * dotFeedTime;
+    if ((long)start > 0L)
+      cutTime = start;
+  }
+  timeoutSet(0);
+  return cutTime;
+}
+
+// Print a job several times, cutting after each copy.  Because of the
+// overlap in motionSet(), the start of each copy is already on its way to
+// the printer while the previous one is being cut.
+void printCopies(uint8_t copies, void (*job)(void), bool partial) {
+  while (copies--) {
+    job();
+    cut(partial);
+  }
+}
+#endif
+
 void flush() { writeBytes(ASCII_FF); }
 
 void setSize(char value) {
@@ -477,6 +1176,10 @@ void setHeatConfig(uint8_t dots, uint8_t time,
                                      uint8_t interval) {
   writeDoubleBytes(ASCII_ESC, '7');       // Esc 7 (print settings)
   writeTripleBytes(dots, time, interval); // Heating dots, heat time, heat interval
+  config.heatDots = dots;
+  config.heatTime = time;
+  config.heatInterval = interval;
+  configSave();
 }
 
 // Print density description from manual:
@@ -487,36 +1190,156 @@ void setHeatConfig(uint8_t dots, uint8_t time,
 // is n(D7-D5)*250us.
 // (Unsure of the default value for either -- not documented)
 void setPrintDensity(uint8_t density, uint8_t breakTime) {
-  writeTripleBytes(ASCII_DC2, '#', (density << 5) | breakTime);
+  sendCommand(CMD_DENSITY, (uint8_t)((density << 5) | breakTime));
 }
 
 // Underlines of different weights can be produced:
 // 0 - no underline
 // 1 - normal underline
 // 2 - thick underline
-void underlineOn(uint8_t weight) {
-  if (weight > 2)
-    weight = 2;
-  writeTripleBytes(ASCII_ESC, '-', weight);
+void underlineOn(uint8_t weight) { sendCommand(CMD_UNDERLINE, weight); }
+
+void underlineOff() { sendCommand(CMD_UNDERLINE, 0); }
+
+// printBitmapRows() is only needed by the sources that can't be looked
+// ahead: the host stream, PackBits data and draft printing.
+#define KP347_RASTER_ROWS (KP347_BITMAP_STREAM || KP347_ASSETS || KP347_DRAFT)
+
+// Byte sources for printBitmapRows().  Each returns the next byte of a
+// row-major bitmap.
+#if KP347_DRAFT
+static const uint8_t *bitmapPtr;
+
+static uint8_t bitmapNext() {
+  uint8_t c = flags.bitmapProgMem ? pgm_read_byte(bitmapPtr) : *bitmapPtr;
+  bitmapPtr++;
+  return c;
+}
+#endif
+
+// A byte lost on the host link must not hang the MCU, nor desync the
+// printer, which still expects the rest of the raster command.  After
+// STREAM_TIMEOUT without data the rest of the current chunk is padded with
+// blank bytes and printBitmapRows() issues no further chunks.
+#if KP347_BITMAP_STREAM
+static uint8_t streamNext() {
+  unsigned long start;
+  int c;
+
+  if (flags.streamFailed)
+    return 0;
+  CYCLES_ENTER(CYCLES_STREAM);
+  start = micros();
+  while ((c = KP347_STREAM_READ()) < 0) {
+    if (KP347_TIME_DIFF(micros(), start) >= STREAM_TIMEOUT) {
+      flags.streamFailed = true;
+      break;
+    }
+  }
+  CYCLES_LEAVE();
+  return (c < 0) ? 0 : (uint8_t)c;
 }
+#endif
+
+// PackBits decoder state.  Runs may span rows, so the state is carried
+// across rows and chunks rather than restarting per row.
+#if KP347_ASSETS
+static const uint8_t *packPtr, *packEnd;
+static uint8_t packRun, packValue;
+
+static uint8_t packBitsNext() {
+  while (packRun == 0) {
+    if (packPtr >= packEnd)
+      return 0; // Truncated data prints as blank
+    int8_t n = (int8_t)*packPtr++;
+    if (n >= 0) {
+      flags.packLiteral = true;
+      packRun = n + 1;
+    } else if (n != -128) { // -128 is a no-op
+      flags.packLiteral = false;
+      packRun = 1 - n;
+      packValue = (packPtr < packEnd) ? *packPtr++ : 0;
+    }
+  }
+  packRun--;
+  if (!flags.packLiteral)
+    return packValue;
+  return (packPtr < packEnd) ? *packPtr++ : 0;
+}
+#endif
+
+#if KP347_DRAFT
+// Draft printing: each pair of rows is merged (OR, so one-dot lines and
+// dithered edges survive) and issued as a single raster row followed by
+// a one-dot feed.  Feeding a row costs a fraction of printing one, so
+// image-heavy slips print in a little over half the time.
+static void printDraftRows(int h, int rowBytes, int rowBytesClipped,
+                           uint8_t (*next)(void)) {
+  uint8_t row[48];
+  int x, y, i;
+
+  CYCLES_ENTER(CYCLES_BITMAP);
+  for (y = 0; (y < h) && !flags.streamFailed; y += 2) {
+    for (x = 0; x < rowBytesClipped; x++)
+      row[x] = next();
+    for (i = rowBytes - rowBytesClipped; i > 0; i--)
+      next();
+    if (y + 1 < h) {
+      for (x = 0; x < rowBytesClipped; x++)
+        row[x] |= next();
+      for (i = rowBytes - rowBytesClipped; i > 0; i--)
+        next();
+    }
 
-void underlineOff() { writeTripleBytes(ASCII_ESC, '-', 0); }
+    timeoutWait();
+    sendByte(ASCII_DC2);
+    sendByte('*');
+    sendByte(1);
+    sendByte(rowBytesClipped);
+    for (x = 0; x < rowBytesClipped; x++)
+      sendByte(row[x]);
+    if (y + 1 < h) {
+      sendByte(ASCII_ESC);
+      sendByte('J');
+      sendByte(1);
+      motionSet(0, 1, 1);
+    } else {
+      motionSet(0, 1, 0);
+    }
+  }
+  CYCLES_LEAVE();
+}
+#endif
 
-void printBitmapFromBitMap(int w, int h, const uint8_t *bitmap,
-                                   bool fromProgMem) {
+#if KP347_RASTER_ROWS
+// Common raster path for all bitmap sources.  A source that sets
+// flags.streamFailed ends the image after the chunk being sent.
+static void printBitmapRows(int w, int h, uint8_t (*next)(void)) {
   int rowBytes, rowBytesClipped, rowStart, chunkHeight, chunkHeightLimit, x, y,
       i;
 
+  flags.streamFailed = false;
   rowBytes = (w + 7) / 8; // Round up to next byte boundary
+  if (rowBytes <= 0)
+    return; // No columns: nothing to print, and no chunk height to divide
   rowBytesClipped = (rowBytes >= 48) ? 48 : rowBytes; // 384 pixels max width
 
+#if KP347_DRAFT
+  if (flags.draftMode) {
+    printDraftRows(h, rowBytes, rowBytesClipped, next);
+    prevByte = '\n';
+    return;
+  }
+#endif
+
   chunkHeightLimit = 256 / rowBytesClipped;
   if (chunkHeightLimit > maxChunkHeight)
     chunkHeightLimit = maxChunkHeight;
   else if (chunkHeightLimit < 1)
     chunkHeightLimit = 1;
 
-  for (i = rowStart = 0; rowStart < h; rowStart += chunkHeightLimit) {
+  for (rowStart = 0; (rowStart < h) && !flags.streamFailed;
+       rowStart += chunkHeightLimit) {
     // Issue up to chunkHeightLimit rows at a time:
     chunkHeight = h - rowStart;
     if (chunkHeight > chunkHeightLimit)
@@ -524,23 +1347,133 @@ void printBitmapFromBitMap(int w, int h, const uint8_t *bitmap,
 
     writeQuadBytes(ASCII_DC2, '*', chunkHeight, rowBytesClipped);
 
+    CYCLES_ENTER(CYCLES_BITMAP);
     for (y = 0; y < chunkHeight; y++) {
-      for (x = 0; x < rowBytesClipped; x++, i++) {
+      for (x = 0; x < rowBytesClipped; x++) {
+        uint8_t c = next();
         timeoutWait();
-        KP347_SEND_BYTE(fromProgMem ? pgm_read_byte(bitmap + i) : *(bitmap + i));
+        sendByte(c);
       }
-      i += rowBytes - rowBytesClipped;
+      for (i = rowBytes - rowBytesClipped; i > 0; i--)
+        next();
     }
-    timeoutSet(chunkHeight * dotPrintTime);
+    CYCLES_LEAVE();
+    motionSet(0, chunkHeight, 0);
   }
   prevByte = '\n';
 }
+#endif
+
+#if KP347_COLUMN_BITMAPS
+// 8x8 bit matrix transpose (Hacker's Delight, transpose8rS32): in[] holds
+// eight rows of eight pixels, MSB leftmost; out[c] receives column c, MSB
+// topmost, which is the bit order ESC * expects.
+static void transpose8(const uint8_t in[8], uint8_t out[8]) {
+  uint32_t x, y, t;
+
+  x = ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) | (in[2] << 8) | in[3];
+  y = ((uint32_t)in[4] << 24) | ((uint32_t)in[5] << 16) | (in[6] << 8) | in[7];
+
+  t = (x ^ (x >> 7)) & 0x00AA00AAUL;
+  x = x ^ t ^ (t << 7);
+  t = (y ^ (y >> 7)) & 0x00AA00AAUL;
+  y = y ^ t ^ (t << 7);
+  t = (x ^ (x >> 14)) & 0x0000CCCCUL;
+  x = x ^ t ^ (t << 14);
+  t = (y ^ (y >> 14)) & 0x0000CCCCUL;
+  y = y ^ t ^ (t << 14);
+  t = (x & 0xF0F0F0F0UL) | ((y >> 4) & 0x0F0F0F0FUL);
+  y = ((x << 4) & 0xF0F0F0F0UL) | (y & 0x0F0F0F0FUL);
+  x = t;
+
+  out[0] = x >> 24;
+  out[1] = x >> 16;
+  out[2] = x >> 8;
+  out[3] = x;
+  out[4] = y >> 24;
+  out[5] = y >> 16;
+  out[6] = y >> 8;
+  out[7] = y;
+}
 
-void printBitmapFromStream(int w, int h) {
-  int rowBytes, rowBytesClipped, rowStart, chunkHeight, chunkHeightLimit, x, y,
-      i, c;
+// ESC * 33 nL nH: 24-dot double-density column image.  The bitmap is cut
+// into 24-row stripes; each stripe is converted one 8-column block at a
+// time (three 8x8 transposes, one per 8-row band), so the working set is
+// 24 source bytes and 24 output bytes however wide the image is.  Each
+// stripe is printed with ESC J 24 and timed as 24 printed dot rows.
+void printBitmapColumns(int w, int h, const uint8_t *bitmap,
+                        bool fromProgMem) {
+  uint8_t in[8], out[3][8];
+  int rowBytes, rowBytesClipped, stripe, bx, band, r, c, row, cols;
+
+  rowBytes = (w + 7) / 8; // Round up to next byte boundary
+  rowBytesClipped = (rowBytes >= 48) ? 48 : rowBytes; // 384 pixels max width
+  cols = rowBytesClipped * 8;
+
+  for (stripe = 0; stripe < h; stripe += 24) {
+    timeoutWait();
+    sendByte(ASCII_ESC);
+    sendByte('*');
+    sendByte(33);
+    sendByte(cols);
+    sendByte(cols >> 8);
+
+    CYCLES_ENTER(CYCLES_BITMAP);
+    for (bx = 0; bx < rowBytesClipped; bx++) {
+      timeoutWait(); // Only waits to keep a send-ahead buffer from overflowing
+      for (band = 0; band < 3; band++) {
+        for (r = 0; r < 8; r++) {
+          row = stripe + band * 8 + r;
+          if (row >= h)
+            in[r] = 0; // Below the image
+          else if (fromProgMem)
+            in[r] = pgm_read_byte(bitmap + row * rowBytes + bx);
+          else
+            in[r] = bitmap[row * rowBytes + bx];
+        }
+        transpose8(in, out[band]);
+      }
+      for (c = 0; c < 8; c++) {
+        for (band = 0; band < 3; band++)
+          sendByte(out[band][c]);
+      }
+    }
+    CYCLES_LEAVE();
+
+    sendByte(ASCII_ESC);
+    sendByte('J');
+    sendByte(24);
+    motionSet(8 + cols * 3, 24, 0);
+  }
+  prevByte = '\n';
+}
+#endif
+
+static bool rowBlank(const uint8_t *row, int n, bool fromProgMem) {
+  while (n--) {
+    if (fromProgMem ? pgm_read_byte(row++) : *row++)
+      return false;
+  }
+  return true;
+}
+
+// Chunk planner for bitmaps in memory, where rows can be looked at before
+// they are sent.  Runs of blank rows are not sent as raster at all but
+// fed with ESC J, at dotFeedTime instead of dotPrintTime per row; the
+// inked rows between them are merged into chunks as large as the
+// printer takes.  A blank run is only worth cutting out if the feed saves
+// more than the extra chunk header and ESC J bytes cost.  A bitmap no
+// taller than one chunk is never split (see bitmapBandHeight()); only a
+// wholly blank one is fed, which is still a single command.
+static void printBitmapPlanned(int w, int h, const uint8_t *bitmap,
+                               bool fromProgMem) {
+  int rowBytes, rowBytesClipped, chunkHeight, chunkHeightLimit, minRun, run, y,
+      end, x;
+  const uint8_t *row;
 
   rowBytes = (w + 7) / 8; // Round up to next byte boundary
+  if (rowBytes <= 0)
+    return; // No columns: nothing to print, and no chunk height to divide
   rowBytesClipped = (rowBytes >= 48) ? 48 : rowBytes; // 384 pixels max width
 
   chunkHeightLimit = 256 / rowBytesClipped;
@@ -549,32 +1482,130 @@ void printBitmapFromStream(int w, int h) {
   else if (chunkHeightLimit < 1)
     chunkHeightLimit = 1;
 
-  for (rowStart = 0; rowStart < h; rowStart += chunkHeightLimit) {
-    // Issue up to chunkHeightLimit rows at a time:
-    chunkHeight = h - rowStart;
-    if (chunkHeight > chunkHeightLimit)
-      chunkHeight = chunkHeightLimit;
+  if (h <= chunkHeightLimit) {
+    minRun = h; // One band, one command
+  } else if (dotPrintTime > dotFeedTime) {
+    for (minRun = 1; minRun * (dotPrintTime - dotFeedTime) < 7 * BYTE_TIME;
+         minRun++)
+      ;
+  } else {
+    minRun = h + 1; // Feeding is no cheaper; never split
+  }
 
-    writeQuadBytes(ASCII_DC2, '*', chunkHeight, rowBytesClipped);
+  for (y = 0; y < h;) {
+    for (run = 0; (y + run < h) &&
+                  rowBlank(bitmap + (y + run) * rowBytes, rowBytesClipped,
+                           fromProgMem);
+         run++)
+      ;
+    if (run >= minRun) {
+      while (run > 0) {
+        x = (run > 255) ? 255 : run;
+        writeTripleBytes(ASCII_ESC, 'J', x);
+        motionSet(0, 0, x);
+        y += x;
+        run -= x;
+      }
+      continue;
+    }
 
-    for (y = 0; y < chunkHeight; y++) {
+    // Extend the chunk up to the limit, stopping short of a blank run
+    // long enough to be fed instead.
+    for (end = y; (end < h) && (end - y < chunkHeightLimit); end++) {
+      for (run = 0; (run < minRun) && (end + run < h) &&
+                    rowBlank(bitmap + (end + run) * rowBytes, rowBytesClipped,
+                             fromProgMem);
+           run++)
+        ;
+      if (run >= minRun)
+        break;
+    }
+
+    chunkHeight = end - y;
+    writeQuadBytes(ASCII_DC2, '*', chunkHeight, rowBytesClipped);
+    CYCLES_ENTER(CYCLES_BITMAP);
+    for (row = bitmap + y * rowBytes; y < end; y++, row += rowBytes) {
       for (x = 0; x < rowBytesClipped; x++) {
-        while ((c = KP347_STREAM_READ()) < 0)
-          ;
         timeoutWait();
-        KP347_SEND_BYTE((uint8_t)c);
-      }
-      for (i = rowBytes - rowBytesClipped; i > 0; i--) {
-        while ((c = KP347_STREAM_READ()) < 0)
-          ;
+        sendByte(fromProgMem ? pgm_read_byte(row + x) : row[x]);
       }
     }
-    timeoutSet(chunkHeight * dotPrintTime);
+    CYCLES_LEAVE();
+    motionSet(0, chunkHeight, 0);
   }
   prevByte = '\n';
 }
 
-void printBitmap() {
+void printBitmapFromBitMap(int w, int h, const uint8_t *bitmap,
+                                   bool fromProgMem) {
+  if ((w <= 0) || (h <= 0))
+    return; // Empty image
+#if KP347_DRAFT
+  if (flags.draftMode) {
+    bitmapPtr = bitmap;
+    flags.bitmapProgMem = fromProgMem;
+    printBitmapRows(w, h, bitmapNext);
+    return;
+  }
+#endif
+#if KP347_COLUMN_BITMAPS
+  if (flags.columnBitmaps) {
+    printBitmapColumns(w, h, bitmap, fromProgMem);
+    return;
+  }
+#endif
+  printBitmapPlanned(w, h, bitmap, fromProgMem);
+}
+
+// Rows printBitmapFromBitMap() issues as one command (the planner doesn't
+// split a bitmap this short), so a caller printing band by band only ever
+// waits between calls.  Bands of this height keep
+// draft row pairs and 24-row column stripes intact.
+int bitmapBandHeight(int w) {
+  int rowBytesClipped, rows;
+
+#if KP347_DRAFT
+  if (flags.draftMode)
+    return 2;
+#endif
+#if KP347_COLUMN_BITMAPS
+  if (flags.columnBitmaps)
+    return 24;
+#endif
+  rowBytesClipped = (w + 7) / 8;
+  if (rowBytesClipped > 48)
+    rowBytesClipped = 48; // 384 pixels max width
+  else if (rowBytesClipped < 1)
+    rowBytesClipped = 1;
+  rows = 256 / rowBytesClipped;
+  if (rows > maxChunkHeight)
+    rows = maxChunkHeight;
+  return (rows < 1) ? 1 : rows;
+}
+
+#if KP347_BITMAP_STREAM
+bool printBitmapFromStream(int w, int h) {
+  printBitmapRows(w, h, streamNext);
+  return !flags.streamFailed;
+}
+#endif
+
+#if KP347_ASSETS
+static void printBitmapFromPackBits(int w, int h, const uint8_t *data,
+                                    uint32_t size) {
+  packPtr = data;
+  packEnd = data + size;
+  packRun = 0;
+  printBitmapRows(w, h, packBitsNext);
+}
+#endif
+
+#if KP347_DRAFT
+void setDraftMode(bool on) { flags.draftMode = on; }
+#endif
+
+#if KP347_BITMAP_STREAM
+bool printBitmap() {
   uint8_t tmp;
   uint16_t width, height;
 
@@ -584,16 +1615,18 @@ void printBitmap() {
   tmp = KP347_STREAM_READ();
   height = (KP347_STREAM_READ() << 8) + tmp;
 
-  printBitmapFromStream(width, height);
+  return printBitmapFromStream(width, height);
 }
+#endif
 
 // Take the printer offline. Print commands sent after this will be
 // ignored until 'online' is called.
-void offline() { writeTripleBytes(ASCII_ESC, '=', 0); }
+void offline() { sendCommand(CMD_ONLINE, 0); }
 
 // Take the printer back online. Subsequent print commands will be obeyed.
-void online() { writeTripleBytes(ASCII_ESC, '=', 1); }
+void online() { sendCommand(CMD_ONLINE, 1); }
 
+#if KP347_SLEEP
 // Put the printer into a low-energy state immediately.
 void sleep() {
   sleepAfter(1); // Can't be 0, that means 'don't sleep'
@@ -602,20 +1635,22 @@ void sleep() {
 // Put the printer into a low-energy state after the given number
 // of seconds.
 void sleepAfter(uint16_t seconds) {
-  if (firmware >= 264) {
-    writeQuadBytes(ASCII_ESC, '8', seconds, seconds >> 8);
-  } else {
-    writeTripleBytes(ASCII_ESC, '8', seconds);
-  }
+  sendCommand(CMD_SLEEP, seconds);
+  if (seconds)
+    STATS_ADD(sleeps, 1);
 }
+#endif
 
 // Wake the printer from a low-energy state.
 void wake() {
+  STATS_ADD(wakes, 1);
   timeoutSet(0);   // Reset timeout counter
   writeBytes(255); // Wake
-  if (firmware >= 264) {
-    delay(50);
+  if (!LEGACY(264)) {
+    timeoutSet(50000L); // Not delay(), so a capture keeps the pause
     writeQuadBytes(ASCII_ESC, '8', 0, 0); // Sleep off (important!)
+    config.sleepTime = 0;
+    configSave();
   } else {
     // Datasheet recommends a 50 mS delay before issuing further commands,
     // but in practice this alone isn't sufficient (e.g. text size/style
@@ -632,53 +1667,262 @@ void wake() {
 // ability.  Returns true for paper, false for no paper.
 // Might not work on all printers!
 bool hasPaper() {
-  if (firmware >= 264) {
-    writeTripleBytes(ASCII_ESC, 'v', 0);
+  int status = readStatus(10, 100);
+
+  return !(status & STATUS_PAPER_OUT);
+}
+
+#if KP347_PROBE
+// Sends a status query and waits for the answer, which the printer only
+// gives once it has worked through everything sent before.  The query is
+// sent raw, as the bytes before it usually are: pacing them would only
+// measure the library's own timing.  Returns the time from start to the
+// answer, or -1 if none came within timeout microseconds.
+static long queryLatency(unsigned long start, unsigned long timeout) {
+  if (!LEGACY(264)) {
+    sendByte(ASCII_ESC);
+    sendByte('v');
   } else {
-    writeTripleBytes(ASCII_GS, 'r', 0);
+    sendByte(ASCII_GS);
+    sendByte('r');
+  }
+  sendByte(0);
+  KP347_FLUSH();
+  if (readByte(timeout) < 0)
+    return -1L;
+  return KP347_TIME_DIFF(micros(), start);
+}
+
+// One buffer probe trial: n NULs (no-ops) and a status query, queued
+// behind enough feeding to outlast sending them if busy is set.  The
+// query is lost if the input buffer overflowed.  Returns the time from
+// the query going out to the answer, or -1.
+static long probeTrial(uint16_t n, bool busy) {
+  unsigned long rows = 0, left;
+  long latency;
+  uint16_t i;
+
+  timeoutWait();
+  if (busy) {
+    rows = (n + 3) * BYTE_TIME / dotFeedTime * 5 / 4 + PROBE_MIN_ROWS;
+    for (left = rows; left > 0; left -= i) {
+      i = (left > 255) ? 255 : left;
+      sendByte(ASCII_ESC);
+      sendByte('J');
+      sendByte(i);
+    }
+  }
+  while (KP347_IS_AVAILABLE())
+    KP347_RECEIVE(); // Drop stale replies
+  for (i = 0; i < n; i++)
+    sendByte(0);
+  KP347_FLUSH();
+  latency = queryLatency(micros(),
+                         rows * dotFeedTime + (n + 3) * BYTE_TIME + 1000000L);
+  // A lost trial may still be feeding; let it finish before the next one
+  motionSet(0, 0, (latency < 0) ? rows : 0);
+  return latency;
+}
+
+// Queues ever more bytes behind a busy mechanism (doubling, then
+// bisecting down to PROBE_STEP bytes) until the status query is lost.
+bool probeBuffer(uint16_t maxBytes, struct bufferProbe *result,
+                 struct printerProfile *profile) {
+  unsigned long n, ok = 0, lost = 0;
+  uint16_t saved = bufferSize;
+  long idle, full;
+
+  bufferSize = 0; // Exact pacing while probing
+  idle = probeTrial(0, false);
+  if (idle < 0) {
+    bufferSize = saved;
+    return false; // No status replies
+  }
+
+  for (n = PROBE_STEP; !lost && (ok < maxBytes); n *= 2) {
+    if (n > maxBytes)
+      n = maxBytes;
+    if (probeTrial(n, true) < 0)
+      lost = n;
+    else
+      ok = n;
   }
+  while (lost && (lost - ok > PROBE_STEP)) {
+    n = ok + (lost - ok) / 2;
+    if (probeTrial(n, true) < 0)
+      lost = n;
+    else
+      ok = n;
+  }
+
+  result->capacity = ok;
+  result->dropAt = lost;
+  result->drainTime = 0;
+  if (ok >= 2 * PROBE_STEP) {
+    // Half the capacity, queued on an idle printer, can't overflow
+    full = probeTrial(ok / 2, false);
+    if (full > idle)
+      result->drainTime = (full - idle) / (ok / 2);
+  }
+
+  bufferSize = ok - ok / 4; // Keep a quarter in reserve
+  if (profile)
+    profile->bufferSize = bufferSize;
+  reset(); // Lost bytes may have left a command half done
+  return true;
+}
 
-  int status = -1;
-  for (uint8_t i = 0; i < 10; i++) {
-    if (KP347_IS_AVAILABLE()) {
-      status = KP347_RECEIVE();
+// Switches on or off the mode a modeCosts entry is for
+static void tuneMode(uint8_t mode, bool on) {
+  switch (mode) {
+  case MODE_COST_JUSTIFY:
+    justify(on ? 'C' : 'L');
+    break;
+  case MODE_COST_UPSIDE_DOWN:
+    on ? upsideDownOn() : upsideDownOff();
+    break;
+  case MODE_COST_INVERSE:
+    on ? inverseOn() : inverseOff();
+    break;
+  case MODE_COST_DOUBLE_HEIGHT:
+    on ? doubleHeightOn() : doubleHeightOff();
+    break;
+  }
+}
+
+// Prints TUNE_LINES lines of solid blocks in the current mode and returns
+// the print time per dot row, given the feed time per row, or 0 if the
+// printer didn't answer.  The printer starts on each line as soon as it
+// has arrived, so link and mechanism overlap: if a line takes longer to
+// print than to send, the lines queue up and the link time of only the
+// first one adds to the total; otherwise the printer waits on the link
+// for every line and only the last line's printing adds to it.  Either
+// way the query's own bytes go out while the printer is still busy, so
+// only the rest of the idle latency is taken off.
+static unsigned long tuneText(long idle, unsigned long feed) {
+  unsigned long start, link = (TUNE_LINE_CHARS + 1) * BYTE_TIME;
+  long t, line;
+  uint8_t i, j;
+
+  start = micros();
+  for (i = 0; i < TUNE_LINES; i++) {
+    for (j = 0; j < TUNE_LINE_CHARS; j++)
+      sendByte(0xDB); // Full block in the default code page
+    sendByte(ASCII_LF);
+  }
+  t = queryLatency(start, 10000000L);
+  if (t < 0)
+    return 0;
+  t -= idle - 3 * BYTE_TIME;
+  line = (t - (long)link) / TUNE_LINES; // Mechanism-bound
+  if (line < (long)link)
+    line = t - TUNE_LINES * (long)link; // Link-bound
+  line -= lineSpacing * feed;
+  return (line > 0L) ? line / charHeight : 1;
+}
+
+// Times a feed, a solid raster band and text in each mode against the
+// printer's status replies, so the profile follows the printer rather
+// than a guess.  Nothing changes unless every step got an answer.
+bool tuneProfile(struct printerProfile *profile, uint8_t safety) {
+  unsigned long feed = 0, print = 0, text, start;
+  uint8_t cost[MODE_COSTS], mode;
+  long idle = -1L, t;
+  uint16_t i, saved = bufferSize;
+
+  bufferSize = 0; // Exact pacing while tuning
+  reset();
+  timeoutWait();
+  while (KP347_IS_AVAILABLE())
+    KP347_RECEIVE(); // Drop stale replies
+  for (i = 0; i < 3; i++) { // Quickest of three bare queries
+    t = queryLatency(micros(), 1000000L);
+    if ((t >= 0) && ((idle < 0) || (t < idle)))
+      idle = t;
+  }
+
+  if (idle >= 0) {
+    start = micros();
+    sendByte(ASCII_ESC);
+    sendByte('J');
+    sendByte(TUNE_FEED_ROWS);
+    t = queryLatency(start, 10000000L);
+    if (t >= 0) {
+      t -= idle + 3 * BYTE_TIME;
+      feed = (t > 0L) ? t / TUNE_FEED_ROWS : 1;
+    }
+  }
+
+  if (feed) {
+    // The profile's print time holds for every row, so time the darkest:
+    // solid black across the full width
+    start = micros();
+    sendByte(ASCII_DC2);
+    sendByte('*');
+    sendByte(TUNE_BAND_ROWS);
+    sendByte(48);
+    for (i = 0; i < TUNE_BAND_ROWS * 48; i++)
+      sendByte(0xFF);
+    t = queryLatency(start, 10000000L);
+    if (t >= 0) {
+      t -= idle + (4 + TUNE_BAND_ROWS * 48) * BYTE_TIME;
+      print = (t > 0L) ? t / TUNE_BAND_ROWS : 1;
+      text = tuneText(idle, feed);
+      if (!text)
+        print = 0;
+      else if (text > print)
+        print = text; // Whichever is slower, text or raster
+    }
+  }
+
+  for (mode = 0; print && (mode < MODE_COSTS); mode++) {
+    tuneMode(mode, true);
+    timeoutWait();
+    text = tuneText(idle, feed);
+    tuneMode(mode, false);
+    if (!text) {
+      print = 0;
       break;
     }
-    delay(100);
+    text = (text * 100 + print / 2) / print;
+    cost[mode] = (text <= 100) ? 0 : (text >= 355) ? 255 : text - 100;
   }
 
-  return !(status & 0b00000100);
+  bufferSize = saved;
+  reset();
+  if (!print)
+    return false; // No status replies
+  dotPrintTime = print * (100 + safety) / 100;
+  dotFeedTime = feed * (100 + safety) / 100;
+  memcpy(modeCost, cost, sizeof(modeCost));
+  profile->firmware = firmware;
+  profile->dotPrintTime = dotPrintTime;
+  profile->dotFeedTime = dotFeedTime;
+  memcpy(profile->modeCost, modeCost, sizeof(modeCost));
+  return true;
 }
+#endif
 
 void setLineHeight(int val) {
-  if (val < 24)
-    val = 24;
-  lineSpacing = val - 24;
-
   // The printer doesn't take into account the current text height
   // when setting line height, making this more akin to inter-line
   // spacing.  Default line spacing is 30 (char height of 24, line
   // spacing of 6).
-  writeTripleBytes(ASCII_ESC, '3', val);
+  sendCommand(CMD_LINE_HEIGHT, val);
+  lineSpacing = config.lineHeight - 24;
 }
 
 void setMaxChunkHeight(int val) { maxChunkHeight = val; }
 
 // These commands work only on printers w/recent firmware ------------------
 
+#if KP347_CHARSET
 // Alters some chars in ASCII 0x23-0x7E range; see datasheet
-void setCharset(uint8_t val) {
-  if (val > 15)
-    val = 15;
-  writeTripleBytes(ASCII_ESC, 'R', val);
-}
+void setCharset(uint8_t val) { sendCommand(CMD_CHARSET, val); }
 
 // Selects alt symbols for 'upper' ASCII values 0x80-0xFF
-void setCodePage(uint8_t val) {
-  if (val > 47)
-    val = 47;
-  writeTripleBytes(ASCII_ESC, 't', val);
-}
+void setCodePage(uint8_t val) { sendCommand(CMD_CODE_PAGE, val); }
+#endif
 
 void tab() {
   writeBytes(ASCII_TAB);
@@ -696,8 +1940,230 @@ void setFont(char font) {
   }
 }
 
-void setCharSpacing(int spacing) {
-  writeTripleBytes(ASCII_ESC, ' ', spacing);
-}
+void setCharSpacing(int spacing) { sendCommand(CMD_CHAR_SPACING, spacing); }
 
 // -------------------------------------------------------------------------
+
+#if KP347_TABLE
+// === Table layout ===
+// Column positions are resolved once per table, in dots, so they stay put
+// when the font or double width changes between rows.  Each row is then
+// issued as a single line that jumps to every cell with ESC $ (absolute
+// print position) instead of padding it out with spaces.
+static uint16_t tableStart[TABLE_MAX_COLUMNS], // Left edge of column, in dots
+                tableWidth[TABLE_MAX_COLUMNS]; // Width of column, in dots
+static char tableAlign[TABLE_MAX_COLUMNS];
+static uint8_t tableWrap; // Bit per column
+static uint8_t tableColumns;
+
+void tableBegin(const struct tableColumn *cols, uint8_t count) {
+  uint16_t pos = 0, width;
+  uint8_t i;
+
+  if (count > TABLE_MAX_COLUMNS)
+    count = TABLE_MAX_COLUMNS;
+
+  tableWrap = 0;
+  for (i = 0; i < count; i++) {
+    if (cols[i].width)
+      width = cols[i].width * charWidth;
+    else
+      width = (384L * cols[i].percent) / 100;
+    if (pos + width > 384)
+      width = 384 - pos; // Clip the last columns to the page
+    tableStart[i] = pos;
+    tableWidth[i] = width;
+    tableAlign[i] = toupper(cols[i].align);
+    if (cols[i].wrap)
+      tableWrap |= 1 << i;
+    pos += width;
+  }
+  tableColumns = count;
+}
+
+// Print one row, wrapping cells onto extra lines as needed.  Rows assume
+// left justification; ESC $ positions are relative to the left margin.
+void tableRow(const char *const *cells) {
+  const char *text[TABLE_MAX_COLUMNS];
+  uint16_t pos, len, take, fit, sent;
+  uint8_t i;
+  bool more;
+
+  for (i = 0; i < tableColumns; i++)
+    text[i] = cells[i] ? cells[i] : "";
+
+  do {
+    more = false;
+    sent = 0;
+    timeoutWait();
+    for (i = 0; i < tableColumns; i++) {
+      fit = tableWidth[i] / charWidth; // Current font, not the one at begin
+      len = strlen(text[i]);
+      take = (len > fit) ? fit : len;
+      if ((tableWrap & (1 << i)) && (take < len)) {
+        // Break at the last space that fits, if there is one
+        uint16_t brk = take;
+        while ((brk > 0) && (text[i][brk] != ' '))
+          brk--;
+        if (brk > 0)
+          take = brk;
+      }
+      if (take > 0) {
+        pos = tableStart[i];
+        if (tableAlign[i] == 'R')
+          pos += (fit - take) * charWidth;
+        else if (tableAlign[i] == 'C')
+          pos += ((fit - take) * charWidth) / 2;
+        sendByte(ASCII_ESC);
+        sendByte('$');
+        sendByte(pos);
+        sendByte(pos >> 8);
+        for (uint16_t j = 0; j < take; j++)
+          sendByte(text[i][j]);
+        sent += 4 + take;
+      }
+      if ((tableWrap & (1 << i)) && (fit > 0)) {
+        text[i] += take;
+        while (*text[i] == ' ')
+          text[i]++; // Don't start a continuation line with blanks
+      } else {
+        text[i] += len; // Truncate, also a column too narrow for the font
+      }
+      if (*text[i])
+        more = true;
+    }
+    sendByte(ASCII_LF);
+    motionSet(sent + 1, textRows(charHeight), lineSpacing);
+  } while (more);
+
+  prevByte = '\n';
+  column = 0;
+}
+#endif
+
+#if KP347_ASSETS
+// === Asset bundles ===
+// See kp347-printer.h for the layout.  Everything is read in place, so a
+// bundle can live in its own flash region (or file) and be replaced
+// without touching the firmware image.  Bundles must be directly
+// addressable; AVR PROGMEM is not supported here.
+
+// 32-bit FNV-1a, with 0 reserved for empty directory slots.
+uint32_t assetHash(const char *name) {
+  uint32_t hash = 2166136261UL;
+  while (*name) {
+    hash ^= (uint8_t)*name++;
+    hash *= 16777619UL;
+  }
+  return hash ? hash : 1;
+}
+
+bool assetBundleValid(const uint8_t *bundle, size_t length) {
+  const struct assetBundleHeader *hdr =
+      (const struct assetBundleHeader *)bundle;
+  const struct assetEntry *dir =
+      (const struct assetEntry *)(bundle + sizeof(*hdr)), *e;
+  const uint16_t *index;
+  uint32_t size, need;
+  uint16_t i;
+
+  if (((uintptr_t)bundle & 3) || (length < sizeof(*hdr)) ||
+      (hdr->magic != ASSET_BUNDLE_MAGIC) ||
+      (hdr->version != ASSET_BUNDLE_VERSION))
+    return false;
+  if (hdr->size > length)
+    return false; // Truncated file or partition; the rest isn't there
+  // slotCount must be a power of two with at least one free slot, so a
+  // miss always terminates.
+  if ((hdr->slotCount == 0) || (hdr->slotCount & (hdr->slotCount - 1)) ||
+      (hdr->assetCount >= hdr->slotCount))
+    return false;
+  if (hdr->size < sizeof(*hdr) + hdr->slotCount * sizeof(struct assetEntry) +
+                      hdr->assetCount * sizeof(uint16_t))
+    return false;
+
+  // Everything the lookups and printAsset() read must lie in the bundle
+  index = (const uint16_t *)(dir + hdr->slotCount);
+  size = hdr->size;
+  for (i = 0; i < hdr->slotCount; i++) {
+    e = &dir[i];
+    if (!e->nameHash)
+      continue;
+    if ((e->nameOffset >= size) ||
+        !memchr(bundle + e->nameOffset, 0, size - e->nameOffset))
+      return false; // Name outside, or not terminated inside
+    if ((e->dataOffset > size) || (e->dataSize > size - e->dataOffset))
+      return false;
+    if ((e->type == ASSET_BITMAP) && !(e->flags & ASSET_FLAG_PACKBITS)) {
+      need = (uint32_t)((e->width + 7) / 8) * e->height;
+      if (e->dataSize < need)
+        return false; // printBitmapFromBitMap() would read past it
+    }
+  }
+  for (i = 0; i < hdr->assetCount; i++) {
+    if ((index[i] >= hdr->slotCount) || !dir[index[i]].nameHash)
+      return false;
+  }
+  return true;
+}
+
+const struct assetEntry *assetFind(const uint8_t *bundle, const char *name) {
+  const struct assetBundleHeader *hdr =
+      (const struct assetBundleHeader *)bundle;
+  const struct assetEntry *dir =
+      (const struct assetEntry *)(bundle + sizeof(*hdr));
+  uint32_t hash = assetHash(name);
+  uint16_t mask = hdr->slotCount - 1, slot = hash & mask;
+
+  // Linear probing; an empty slot ends the chain.
+  while (dir[slot].nameHash) {
+    if ((dir[slot].nameHash == hash) &&
+        !strcmp((const char *)bundle + dir[slot].nameOffset, name))
+      return &dir[slot];
+    slot = (slot + 1) & mask;
+  }
+  return NULL;
+}
+
+const struct assetEntry *assetFindId(const uint8_t *bundle, uint16_t id) {
+  const struct assetBundleHeader *hdr =
+      (const struct assetBundleHeader *)bundle;
+  const struct assetEntry *dir =
+      (const struct assetEntry *)(bundle + sizeof(*hdr));
+  const uint16_t *index = (const uint16_t *)(dir + hdr->slotCount);
+
+  if ((id >= hdr->assetCount) || (index[id] >= hdr->slotCount) ||
+      !dir[index[id]].nameHash)
+    return NULL;
+  return &dir[index[id]];
+}
+
+unsigned long assetPrintTime(const struct assetEntry *asset) {
+  unsigned long printRows = asset->printRows, feedRows = asset->feedRows;
+
+  if (KP347_DRAFT && flags.draftMode && (asset->type == ASSET_BITMAP)) {
+    feedRows += printRows / 2; // Every second row is fed instead
+    printRows -= printRows / 2;
+  }
+  return printRows * dotPrintTime + feedRows * dotFeedTime;
+}
+
+void printAsset(const uint8_t *bundle, const struct assetEntry *asset) {
+  const uint8_t *data = bundle + asset->dataOffset;
+  uint32_t i;
+
+  switch (asset->type) {
+  case ASSET_BITMAP:
+    if (asset->flags & ASSET_FLAG_PACKBITS)
+      printBitmapFromPackBits(asset->width, asset->height, data,
+                              asset->dataSize);
+    else
+      printBitmapFromBitMap(asset->width, asset->height, data, false);
+    break;
+  case ASSET_TEXT:
+    for (i = 0; i < asset->dataSize; i++)
+      write(data[i]);
+    break;
+  }
+}
+#endif
@@ -5,7 +5,12 @@
 #ifndef ADAFRUIT_THERMAL_H
 #define ADAFRUIT_THERMAL_H
 
+#ifdef __cplusplus
+extern "C" { // Also covers the HAL headers port.h pulls in
+#endif
+
 #include "port.h"
+#include "kp347-config.h"
 
 // Internal character sets used with ESC R n
 #define CHARSET_USA 0           //!< American character set
@@ -72,6 +77,55 @@
 #define CODEPAGE_CP856 46       //!< Hebrew character code page
 #define CODEPAGE_CP874 47       //!< Thai character code page
 
+#define STATUS_PAPER_OUT 0x04 //!< Status byte bit set when out of paper
+
+/*!
+ * Signed difference a - b of two micros() readings.  micros() wraps at 32
+ * bits on the MCU, and on the Linux port with kp347LinuxWrapClock(), so
+ * times are always compared through this, never directly.
+ */
+#define KP347_TIME_DIFF(a, b) ((int32_t)(uint32_t)((a) - (b)))
+
+#define FIRMWARE_AUTO 0xFFFF //!< begin() value to detect the firmware version
+#define FIRMWARE_LEGACY 260  //!< Assumed when detection gets no answer: only
+                             //!< older firmware lacks GS I
+
+/*!
+ * Text print modes that slow printing down; see printerProfile.modeCost
+ */
+enum modeCosts {
+  MODE_COST_JUSTIFY,       /**< Centered or right-justified (line is buffered) */
+  MODE_COST_UPSIDE_DOWN,   /**< Upside-down (line is buffered) */
+  MODE_COST_INVERSE,       /**< Inverse (many more dots heated) */
+  MODE_COST_DOUBLE_HEIGHT, /**< Double height (denser glyphs) */
+  MODE_COSTS,              /**< Number of mode costs */
+};
+
+/*!
+ * Timing profile, chosen by firmware version in begin()
+ */
+struct printerProfile {
+  uint16_t firmware;          /**< Lowest firmware version this applies to */
+  unsigned long dotPrintTime; /**< Time to print one dot line, in us */
+  unsigned long dotFeedTime;  /**< Time to feed one dot line, in us */
+  uint8_t cutterOffset;       /**< Dot rows from print head to cutter */
+  unsigned long cutTime;      /**< Time for the cutter to cut, in us */
+  bool columnBitmaps;         /**< Print memory bitmaps with ESC * columns */
+  uint8_t modeCost[MODE_COSTS]; /**< Extra print time of text lines in each
+                                   mode (modeCosts), in percent; added up */
+  uint16_t bufferSize; /**< Input buffer bytes to send ahead into while the
+                          printer is busy, 0 for none; see probeBuffer() */
+};
+
+/*!
+ * Input buffer measurements from probeBuffer()
+ */
+struct bufferProbe {
+  uint16_t capacity;       /**< Most bytes queued behind a busy printer without loss */
+  uint16_t dropAt;         /**< Fewest queued bytes that lost some, 0 if none did */
+  unsigned long drainTime; /**< Time an idle printer takes per queued byte, in us */
+};
+
 /*!
  * Barcode types used with GS k m
  */
@@ -87,6 +141,126 @@ enum barcodes {
   CODE128, /**< CODE128 barcode system. 2<=num<=255 */
 };
 
+/*!
+ * Asset types stored in an asset bundle
+ */
+enum assetTypes {
+  ASSET_BITMAP, /**< Row-major 1bpp bitmap, as for printBitmapFromBitMap() */
+  ASSET_TEXT,   /**< Text/command template, issued through write() */
+};
+
+#define ASSET_BUNDLE_MAGIC 0x4241504BUL //!< "KPAB" read as a little-endian word
+#define ASSET_BUNDLE_VERSION 1          //!< Bundle layout version
+#define ASSET_FLAG_PACKBITS (1 << 0)    //!< Asset data is PackBits encoded
+
+/*!
+ * Asset bundle header.  A bundle is a single little-endian image meant to
+ * be used in place (memory-mapped flash, or mmap() on Linux):
+ *
+ *   struct assetBundleHeader
+ *   struct assetEntry[slotCount]   hash directory, open addressing
+ *   uint16_t[assetCount]           id index, slot number of each id
+ *   names and data                 data 4-byte aligned
+ *
+ * All offsets are from the start of the bundle.
+ */
+struct assetBundleHeader {
+  uint32_t magic;      /**< ASSET_BUNDLE_MAGIC */
+  uint16_t version;    /**< ASSET_BUNDLE_VERSION */
+  uint16_t assetCount; /**< Number of assets, ids run 0..assetCount-1 */
+  uint16_t slotCount;  /**< Directory slots, a power of two > assetCount */
+  uint16_t reserved;   /**< Must be 0 */
+  uint32_t size;       /**< Total bundle size in bytes */
+};
+
+/*!
+ * Asset directory entry, 32 bytes
+ */
+struct assetEntry {
+  uint32_t nameHash;   /**< FNV-1a hash of the name, 0 marks an empty slot */
+  uint32_t nameOffset; /**< Offset of the NUL-terminated name */
+  uint32_t dataOffset; /**< Offset of the asset data */
+  uint32_t dataSize;   /**< Size of the asset data in bytes */
+  uint16_t id;         /**< Numeric id of the asset */
+  uint16_t width;      /**< Bitmap width in pixels */
+  uint16_t height;     /**< Bitmap height in pixels */
+  uint8_t type;        /**< Value from assetTypes */
+  uint8_t flags;       /**< ASSET_FLAG_* encoding flags */
+  uint16_t printRows;  /**< Dot rows printed, for timing */
+  uint16_t feedRows;   /**< Dot rows fed, for timing */
+  uint32_t reserved;   /**< Must be 0 */
+};
+
+/*!
+ * Record types of a captured job (see captureBegin()).  Values are
+ * little-endian.  Marks carry timing in dot rows rather than time, so
+ * every printer can replay the job with its own profile.
+ */
+enum fanoutRecords {
+  FANOUT_DATA,   /**< u16 length, bytes for the printer */
+  FANOUT_WAIT,   /**< u32 microseconds, as given to timeoutSet() */
+  FANOUT_MOTION, /**< u16 rows printed, u16 rows fed */
+  FANOUT_CUT,    /**< u8 partial; the printer's own cutter offset is used */
+};
+
+/*!
+ * Regions timed with the port's cycle counter when KP347_CYCLES is set.
+ * Each cycle is charged to the innermost region only, so a bitmap's
+ * waits count as CYCLES_WAIT and its bytes as CYCLES_SEND.
+ */
+enum cycleRegions {
+  CYCLES_SEND,         /**< Sending a byte to the port */
+  CYCLES_WAIT,         /**< Waiting for the printer in timeoutWait() */
+  CYCLES_BITMAP,       /**< Bitmap row and column loops */
+  CYCLES_CHAR_VALUES,  /**< adjustCharValues() */
+  CYCLES_STREAM,       /**< Waiting for bitmap data from the host stream */
+  CYCLE_REGIONS,
+};
+
+/*!
+ * Counter of one cycleRegions entry
+ */
+struct cycleCount {
+  unsigned long calls; /**< Times the region was entered */
+  uint64_t cycles;     /**< Cycles spent in it */
+};
+
+#define STATS_WAIT_BUCKETS 8 //!< Buckets of the wait-time histogram
+
+/*!
+ * Counters kept with KP347_STATS.  Wait bucket i counts the waits of up
+ * to 4^i ms; the last one, any longer.  All counters wrap.
+ */
+struct printerStats {
+  uint32_t bytesSent;     /**< Bytes sent to the printer */
+  uint16_t aheadBytes;    /**< Bytes sent ahead, not known to be printed yet */
+  uint32_t waits;         /**< Times timeoutWait() had to wait */
+  uint64_t waitMicros;    /**< Time spent in those waits */
+  uint32_t waitBuckets[STATS_WAIT_BUCKETS]; /**< Waits by length */
+  uint32_t statusQueries; /**< Status queries sent */
+  uint32_t statusLost;    /**< Queries readStatus() gave up on: the printer
+                               is off, or its input buffer overran */
+  uint32_t overruns;      /**< Of those, the ones lost while the printer
+                               was on: it answered a later query */
+  uint32_t paperOuts;     /**< Replies finding the paper out after it wasn't */
+  uint32_t recoveries;    /**< Replies finding it back after that */
+  uint32_t sleeps;        /**< Auto-sleep commands (sleep(), sleepAfter()) */
+  uint32_t wakes;         /**< Calls to wake(), begin()'s included */
+  bool paperOut;          /**< Last reply said the paper is out */
+};
+
+#define TABLE_MAX_COLUMNS 8 //!< Most columns a table may have
+
+/*!
+ * Column description used with tableBegin()
+ */
+struct tableColumn {
+  uint8_t width;   /**< Width in characters of the current font, 0 to use percent */
+  uint8_t percent; /**< Share of the page width, in percent, when width is 0 */
+  char align;      /**< 'L', 'C' or 'R', as with justify() */
+  bool wrap;       /**< Wrap overlong cells onto extra lines instead of truncating */
+};
+
 /*!
   * @brief Writes a character to the thermal printer
   * @param c Character to write
@@ -94,9 +268,28 @@ enum barcodes {
   */
 size_t write(uint8_t c);
 /*!
-  * @param version firmware version as integer, e.g. 268 = 2.68 firmware
+  * @param version firmware version as integer, e.g. 268 = 2.68 firmware,
+  * or FIRMWARE_AUTO to query the printer (the result is kept for warm restarts)
   */
 void begin(uint16_t version);
+#if KP347_AUTODETECT
+/*!
+  * @brief Queries the printer for its firmware version (GS I)
+  * @return Returns the version as integer, e.g. 269, or 0 if there was no answer
+  */
+uint16_t detectFirmware();
+#endif
+/*!
+  * @brief Replaces the timing profile chosen by begin()
+  * @param profile Profile to use; times are copied as with setTimes()
+  */
+void setProfile(const struct printerProfile *profile);
+/*!
+  * @brief Sets the extra print time of text lines in one mode
+  * @param mode Value from modeCosts
+  * @param percent Extra time in percent of the line's print time
+  */
+void setModeCost(uint8_t mode, uint8_t percent);
 /*!
   * @brief Disables bold text
   */
@@ -121,6 +314,31 @@ void doubleWidthOff();
   * @brief Enables double-width text
   */
 void doubleWidthOn();
+#if KP347_CUTTER
+/*!
+  * @brief Feeds the last line past the cutter and cuts the paper
+  * @param partial true for a partial cut, false for a full cut
+  */
+void cut(bool partial);
+/*!
+  * @brief Sets the time the cutter takes to cut
+  * @param t cut time in microseconds
+  */
+void setCutTime(unsigned long t);
+/*!
+  * @brief Measures the cut time with a status query; uses one cut of paper
+  * @param partial true for a partial cut, false for a full cut
+  * @return Returns the cut time in microseconds, also used from now on
+  */
+unsigned long measureCutTime(bool partial);
+/*!
+  * @brief Prints a job several times, cutting after each copy
+  * @param copies How many copies to print
+  * @param job Function issuing one copy
+  * @param partial true for partial cuts, false for full cuts
+  */
+void printCopies(uint8_t copies, void (*job)(void), bool partial);
+#endif
 /*!
   * @brief Feeds by the specified number of lines 
   * @param x How many lines to feed 
@@ -156,32 +374,65 @@ void offline();
   * @brief Put the printer into an online state after previously put offline
   */
 void online();
+#if KP347_BARCODE
 /*!
   * @brief Print a barcode
   * @param text The specified text/number (the meaning varies based on the type of barcode) and type to write to the barcode
   * @param type Value from the datasheet or class-level variables like UPC-A. Note the type value changes depending on the firmware version so use class-level values where possible
   */
 void printBarcode(const char *text, uint8_t type);
+#endif
 /*!
-  * @brief Prints a bitmap
+  * @brief Prints a bitmap; an empty one (w or h 0) prints nothing
   * @param w Width of the image in pixels
   * @param h Height of the image in pixels
   * @param bitmap Bitmap data, from a file.
   * @param fromProgMem
   */
-void printBitmapFromBitmap(int w, int h, const uint8_t *bitmap, bool fromProgMem);
+void printBitmapFromBitMap(int w, int h, const uint8_t *bitmap, bool fromProgMem);
+/*!
+  * @brief Rows of a bitmap printBitmapFromBitMap() issues as a single command
+  * @param w Width of the image in pixels
+  * @return Returns the band height to print an image in without waiting
+  * inside the calls
+  */
+int bitmapBandHeight(int w);
+#if KP347_COLUMN_BITMAPS
+/*!
+  * @brief Prints a bitmap in 24-dot column format (ESC *) instead of raster
+  * @param w Width of the image in pixels
+  * @param h Height of the image in pixels
+  * @param bitmap Bitmap data, row-major as for printBitmapFromBitMap()
+  * @param fromProgMem
+  */
+void printBitmapColumns(int w, int h, const uint8_t *bitmap, bool fromProgMem);
+#endif
+#if KP347_BITMAP_STREAM
 /*!
   * @brief Prints a bitmap
   * @param w Width of the image in pixels
   * @param h Height of the image in pixels
   * @param fromStream Stream to get bitmap data from
+  * @return Returns false if the stream timed out; the chunk in progress
+  * was padded with blank rows and the rest of the image was not printed
   */
-void printBitmapFromStream(int w, int h);
+bool printBitmapFromStream(int w, int h);
 /*!
   * @brief Prints a bitmap
   * @param fromStream Stream to get bitmap data from
+  * @return Returns false if the stream timed out, as printBitmapFromStream()
   */
-void printBitmap();
+bool printBitmap();
+#endif
+#if KP347_DRAFT
+/*!
+  * @brief Enables or disables draft bitmap printing: every second row is
+  * merged into its neighbour and fed instead of printed, for about half
+  * the print time at half the vertical resolution
+  * @param on true to enable draft mode
+  */
+void setDraftMode(bool on);
+#endif
 /*!
   * @brief Sets text to normal mode
   */ 
@@ -190,11 +441,13 @@ void normal();
   * @brief Reset the printer
   */
 void reset();
+#if KP347_BARCODE
 /*!
   * @brief Sets the barcode height
   * @param val Desired height of the barcode
   */
 void setBarcodeHeight(uint8_t val);
+#endif
 /*!
   * @brief Sets the font
   * @param font Desired font, either A or B
@@ -205,6 +458,7 @@ void setFont(char font);
   * @param spacing Desired character spacing
   */
 void setCharSpacing(int spacing); // Only works w/recent firmware
+#if KP347_CHARSET
 /*!
   * @brief Sets the character set
   * @param val Value of the desired character set
@@ -215,6 +469,7 @@ void setCharset(uint8_t val);
   * @param val Value of the desired character code page
   */
 void setCodePage(uint8_t val);
+#endif
 /*!
   * @brief Sets the default settings
   */
@@ -225,7 +480,8 @@ void setDefault();
   */
 void setLineHeight(int val);
 /*!
-  * @brief Set max rows to write
+  * @brief Set max rows to write per raster command.  Bitmaps in memory are
+  * otherwise chunked automatically (blank rows fed, the rest merged)
   * @param val Max rows to write
   */
 void setMaxChunkHeight(int val);
@@ -253,6 +509,7 @@ void setHeatConfig(uint8_t dots, uint8_t time, uint8_t interval);
   * @param breakTime printing break time
   */
 void setPrintDensity(uint8_t density, uint8_t breakTime);
+#if KP347_SLEEP
 /*!
   * @brief Puts the printer into a low-energy state immediately
   */
@@ -262,6 +519,7 @@ void sleep();
   * @param seconds How many seconds to wait until sleeping
   */
 void sleepAfter(uint16_t seconds);
+#endif
 /*!
   * @brief Disables delete line mode
   */ 
@@ -291,6 +549,35 @@ void timeoutSet(unsigned long);
   * @brief Waits for the prior task to complete 
   */
 void timeoutWait();
+/*!
+  * @brief Time until the task set with timeoutSet() completes
+  * @return Returns microseconds left, 0 if timeoutWait() would not wait
+  */
+unsigned long timeoutRemaining();
+#if KP347_CYCLES
+/*!
+  * @brief Cycle counts of the library's hot regions
+  * @return Returns CYCLE_REGIONS counters, indexed by cycleRegions
+  */
+const struct cycleCount *cycleCounts();
+/*!
+  * @brief Clears the cycle counts
+  */
+void cycleCountsReset();
+#endif
+#if KP347_STATS
+/*!
+  * @brief Copies the counters.  Safe from another thread, e.g. a metrics
+  * exporter: it never blocks the printing thread, and retries if it
+  * caught the counters halfway through an update.
+  * @param out Where to put them
+  */
+void statsRead(struct printerStats *out);
+/*!
+  * @brief Clears the counters; call from the printing thread only
+  */
+void statsReset();
+#endif
 /*!
   * @brief Disables underline
   */
@@ -312,10 +599,125 @@ void upsideDownOn();
   * @brief Wakes device that was in sleep mode
   */
 void wake();
+#if KP347_TABLE
+/*!
+  * @brief Starts a table, resolving the column layout once
+  * @param cols Column descriptions, copied so they need not outlive the call
+  * @param count Number of columns, at most TABLE_MAX_COLUMNS
+  */
+void tableBegin(const struct tableColumn *cols, uint8_t count);
+/*!
+  * @brief Prints one table row as a single positioned line
+  * @param cells One NUL-terminated string per column, NULL for an empty cell
+  */
+void tableRow(const char *const *cells);
+#endif
+#if KP347_ASSETS
+/*!
+  * @brief Hashes an asset name the way bundle directories do
+  * @param name NUL-terminated asset name
+  * @return Returns the 32-bit FNV-1a hash, never 0
+  */
+uint32_t assetHash(const char *name);
+/*!
+  * @brief Checks an asset bundle: header, and that every name, data
+  * range and id index entry lies within its size, and its size within
+  * the bytes there are.  Call before the lookups on a bundle that may be
+  * corrupt or truncated.
+  * @param bundle Start of the bundle, 4-byte aligned
+  * @param length Bytes available at bundle (file or partition size)
+  * @return Returns true if the bundle can be used
+  */
+bool assetBundleValid(const uint8_t *bundle, size_t length);
+/*!
+  * @brief Looks up an asset by name
+  * @param bundle Start of a valid bundle
+  * @param name NUL-terminated asset name
+  * @return Returns the directory entry, or NULL if not found
+  */
+const struct assetEntry *assetFind(const uint8_t *bundle, const char *name);
+/*!
+  * @brief Looks up an asset by id
+  * @param bundle Start of a valid bundle
+  * @param id Asset id
+  * @return Returns the directory entry, or NULL if not found
+  */
+const struct assetEntry *assetFindId(const uint8_t *bundle, uint16_t id);
+/*!
+  * @brief Estimated time to print an asset with the current timing
+  * @param asset Directory entry
+  * @return Returns the time in microseconds
+  */
+unsigned long assetPrintTime(const struct assetEntry *asset);
+/*!
+  * @brief Prints an asset straight from the bundle
+  * @param bundle Start of a valid bundle
+  * @param asset Directory entry from assetFind() or assetFindId()
+  */
+void printAsset(const uint8_t *bundle, const struct assetEntry *asset);
+#endif
+#if KP347_FANOUT
+/*!
+  * @brief Starts recording a job instead of printing it.  Library calls
+  * until captureEnd() only append to buf and never wait, so a job is
+  * encoded once and can be sent to several printers (see kp347-fanout.h).
+  * The library's view of the printer settings follows the captured
+  * calls.  Don't query the printer (hasPaper() etc.) while capturing.
+  * @param buf Buffer to record into
+  * @param size Size of buf in bytes
+  */
+void captureBegin(uint8_t *buf, size_t size);
+/*!
+  * @brief Stops recording
+  * @return Returns the length of the job, or 0 if buf was too small
+  */
+size_t captureEnd();
+#endif
 /*!
   * @brief Whether or not the printer has paper
   * @return Returns true if there is still paper
   */
 bool hasPaper();  
+/*!
+  * @brief Sends a status query without waiting for the reply
+  */
+void statusRequest();
+/*!
+  * @brief Checks for the reply to statusRequest()
+  * @return Returns the status byte, or -1 if it hasn't arrived (yet)
+  */
+int statusPoll();
+#if KP347_PROBE
+/*!
+  * @brief Measures the printer's input buffer by queueing bytes behind a
+  * paper feed until a status query gets lost.  Feeds a few centimetres of
+  * paper per step, more on slow links, and ends with reset().  The usable
+  * size (three quarters of the capacity) is used for send-ahead from now on.
+  * @param maxBytes Largest queue to try
+  * @param result Receives the measurements
+  * @param profile Profile to store the usable size in, or NULL
+  * @return Returns false if the printer doesn't answer status queries
+  */
+bool probeBuffer(uint16_t maxBytes, struct bufferProbe *result,
+                 struct printerProfile *profile);
+/*!
+  * @brief Measures the feed time, the print time of solid raster and text
+  * rows and the mode costs against the printer's status replies, and
+  * uses them from now on.  Prints about 6 cm; starts and ends with reset().
+  * The times come from the printer itself, not from shrinking a profile
+  * against the virtual printer (kp347-virtual.h) until it overruns, which
+  * would only find the timing the virtual printer was given.
+  * @param profile Receives firmware, times and mode costs; the other
+  * fields are left alone
+  * @param safety Margin added to the measured times, in percent
+  * @return Returns false if the printer doesn't answer status queries;
+  * nothing is changed then
+  */
+bool tuneProfile(struct printerProfile *profile, uint8_t safety);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif // ADAFRUIT_THERMAL_H
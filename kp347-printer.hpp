@@ -0,0 +1,357 @@
+/*!
+ * @file kp347-printer.hpp
+ *
+ * C++20 coroutine facade for host applications.  Print flows are written
+ * as straight-line coroutines and suspend, instead of blocking, while the
+ * pacing engine says the printer is busy or a status reply is pending:
+ *
+ *   kp347::Task receipt(kp347::Printer &printer, const char *text) {
+ *     kp347::Job job = co_await printer.job();
+ *     if (!co_await job.hasPaper())
+ *       co_return;
+ *     co_await job.print(text);
+ *     co_await job.feed(3);
+ *   }
+ *
+ * The host event loop calls Printer::poll(), which resumes whatever is
+ * due and says how long the loop may sleep before calling it again.  A
+ * waiting flow costs only its coroutine frame, so any number of flows can
+ * queue for the printer on one thread.
+ *
+ * The library keeps its state in globals, so it drives a single printer
+ * and there must be one Printer object.  Jobs hold the printer
+ * exclusively, so receipts from concurrent flows are not interleaved;
+ * they are granted in the order they were asked for.  Library calls still
+ * run to completion once started: text is issued a line per step and
+ * bitmaps a chunk per step (see bitmapBandHeight()), so the pacing waits
+ * happen in poll() rather than inside the library.
+ */
+
+#ifndef KP347_PRINTER_HPP
+#define KP347_PRINTER_HPP
+
+#include <coroutine>
+#include <exception>
+#include <type_traits>
+#include <utility>
+
+#include "kp347-printer.h"
+
+namespace kp347 {
+
+constexpr unsigned long STATUS_TIMEOUT = 1000000UL; //!< Wait for a status reply, in us
+constexpr long STATUS_POLL = 1000L; //!< poll() interval while a reply is pending, in us
+
+/*!
+ * Return type for top-level print flows.  The flow starts at once and
+ * frees itself when it returns; nothing can await it.
+ */
+struct Task {
+  struct promise_type {
+    Task get_return_object() noexcept { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { std::terminate(); }
+  };
+};
+
+namespace detail {
+
+struct StepPromiseBase {
+  std::coroutine_handle<> continuation;
+
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    template <typename P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+      return h.promise().continuation; // Straight back to the awaiting flow
+    }
+    void await_resume() noexcept {}
+  };
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  FinalAwaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception() noexcept { std::terminate(); }
+};
+
+template <typename T> struct StepPromise : StepPromiseBase {
+  T value{};
+  void return_value(T v) noexcept { value = std::move(v); }
+};
+
+template <> struct StepPromise<void> : StepPromiseBase {
+  void return_void() noexcept {}
+};
+
+} // namespace detail
+
+/*!
+ * Awaitable sub-operation of a flow, e.g. the result of Job::print().
+ * Starts when awaited and hands its result to the awaiting coroutine.
+ */
+template <typename T = void> class [[nodiscard]] Step {
+public:
+  struct promise_type : detail::StepPromise<T> {
+    Step get_return_object() noexcept {
+      return Step(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+  };
+
+  Step(Step &&other) noexcept : handle(std::exchange(other.handle, {})) {}
+  Step(const Step &) = delete;
+  Step &operator=(const Step &) = delete;
+  ~Step() {
+    if (handle)
+      handle.destroy();
+  }
+
+  bool await_ready() const noexcept { return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept {
+    handle.promise().continuation = c;
+    return handle;
+  }
+  T await_resume() noexcept {
+    if constexpr (!std::is_void_v<T>)
+      return std::move(handle.promise().value);
+  }
+
+private:
+  explicit Step(std::coroutine_handle<promise_type> h) : handle(h) {}
+  std::coroutine_handle<promise_type> handle;
+};
+
+class Job;
+
+/*!
+ * The printer, shared by all flows.  Call begin() (and setDefault() etc.)
+ * as usual before starting flows.
+ */
+class Printer {
+public:
+  Printer() = default;
+  Printer(const Printer &) = delete;
+  Printer &operator=(const Printer &) = delete;
+
+  /*!
+   * @brief Awaitable for exclusive use of the printer
+   * @return co_await yields a Job; the printer is released when it is destroyed
+   */
+  auto job() noexcept;
+
+  /*!
+   * @brief Resumes every flow whose wait is over; call from the event loop
+   * @return Returns microseconds until the next call is useful, or -1 if no
+   * flow is waiting on the printer
+   */
+  long poll() {
+    for (;;) {
+      std::coroutine_handle<> h;
+
+      if (granted) {
+        h = std::exchange(granted, {});
+      } else if (state == PACING) {
+        unsigned long left = timeoutRemaining();
+        if (left)
+          return (long)left;
+        state = IDLE;
+        h = waiter;
+      } else if (state == STATUS) {
+        int c = statusPoll();
+        if ((c < 0) &&
+            (KP347_TIME_DIFF(micros(), statusStart) < (long)STATUS_TIMEOUT))
+          return STATUS_POLL;
+        status = c;
+        state = IDLE;
+        h = waiter;
+      } else {
+        return -1;
+      }
+      h.resume();
+    }
+  }
+
+private:
+  friend class Job;
+
+  // Flows queued in job(), linked through their awaiters
+  struct Waiter {
+    std::coroutine_handle<> handle;
+    Waiter *next;
+  };
+
+  // Suspends the job holder until the pacing deadline has passed
+  struct Paced {
+    Printer &printer;
+    bool await_ready() const noexcept { return timeoutRemaining() == 0; }
+    void await_suspend(std::coroutine_handle<> h) noexcept {
+      printer.waiter = h;
+      printer.state = PACING;
+    }
+    void await_resume() const noexcept {}
+  };
+
+  // Suspends the job holder until the status reply arrives or times out
+  struct Reply {
+    Printer &printer;
+    bool await_ready() noexcept {
+      printer.status = statusPoll();
+      return printer.status >= 0;
+    }
+    void await_suspend(std::coroutine_handle<> h) noexcept {
+      printer.waiter = h;
+      printer.statusStart = micros();
+      printer.state = STATUS;
+    }
+    int await_resume() const noexcept { return printer.status; }
+  };
+
+  void release() noexcept {
+    if (head) {
+      granted = head->handle; // Still held, now by the next flow
+      if (!(head = head->next))
+        tail = nullptr;
+    } else {
+      held = false;
+    }
+  }
+
+  enum { IDLE, PACING, STATUS } state = IDLE;
+  std::coroutine_handle<> waiter;  // Job holder, while state != IDLE
+  std::coroutine_handle<> granted; // Next holder, to be resumed by poll()
+  Waiter *head = nullptr, *tail = nullptr;
+  bool held = false;
+  unsigned long statusStart = 0;
+  int status = -1;
+};
+
+/*!
+ * Exclusive use of the printer.  All printing in a flow goes through its
+ * Job; each operation is a Step to co_await.
+ */
+class [[nodiscard]] Job {
+public:
+  Job(Job &&other) noexcept : printer(std::exchange(other.printer, nullptr)) {}
+  Job(const Job &) = delete;
+  Job &operator=(const Job &) = delete;
+  ~Job() {
+    if (printer)
+      printer->release();
+  }
+
+  /*!
+   * @brief Waits until the printer has finished the previous task
+   */
+  Step<> ready() { co_await Printer::Paced{*printer}; }
+
+  /*!
+   * @brief Prints text through write(), a line per step
+   * @param text NUL-terminated text; must stay valid until the step is done
+   */
+  Step<> print(const char *text) {
+    while (*text) {
+      co_await Printer::Paced{*printer};
+      do {
+        ::write((uint8_t)*text);
+      } while (*text++ != '\n' && *text);
+    }
+  }
+
+  /*!
+   * @brief Prints a bitmap held in memory, a chunk per step
+   * @param w Width of the image in pixels
+   * @param h Height of the image in pixels
+   * @param bitmap Row-major image data; must stay valid until the step is done
+   */
+  Step<> printBitmap(int w, int h, const uint8_t *bitmap) {
+    int band = bitmapBandHeight(w), rowBytes = (w + 7) / 8;
+
+    for (int y = 0; y < h; y += band) {
+      co_await Printer::Paced{*printer};
+      printBitmapFromBitMap(w, (h - y < band) ? h - y : band,
+                            bitmap + y * rowBytes, false);
+    }
+  }
+
+  /*!
+   * @brief Feeds by the specified number of lines
+   * @param lines How many lines to feed
+   */
+  Step<> feed(uint8_t lines) {
+    co_await Printer::Paced{*printer};
+    ::feed(lines);
+  }
+
+#if KP347_CUTTER
+  /*!
+   * @brief Feeds the last line past the cutter and cuts the paper
+   * @param partial true for a partial cut, false for a full cut
+   */
+  Step<> cut(bool partial) {
+    co_await Printer::Paced{*printer};
+    ::cut(partial);
+  }
+#endif
+
+  /*!
+   * @brief Runs any other library call once the printer is ready
+   * @param call Callable, e.g. a lambda calling justify() or setSize()
+   */
+  template <typename F> Step<> call(F call) {
+    co_await Printer::Paced{*printer};
+    call();
+  }
+
+  /*!
+   * @brief Queries the printer status without blocking
+   * @return co_await yields the status byte, or -1 if the printer didn't
+   * answer within STATUS_TIMEOUT
+   */
+  Step<int> status() {
+    co_await Printer::Paced{*printer};
+    statusRequest();
+    co_return co_await Printer::Reply{*printer};
+  }
+
+  /*!
+   * @brief Non-blocking hasPaper()
+   * @return co_await yields true if there is still paper
+   */
+  Step<bool> hasPaper() {
+    int s = co_await status();
+    co_return !(s & STATUS_PAPER_OUT);
+  }
+
+private:
+  friend class Printer;
+  explicit Job(Printer *p) noexcept : printer(p) {}
+  Printer *printer;
+};
+
+inline auto Printer::job() noexcept {
+  struct Acquire {
+    Printer &printer;
+    Waiter node;
+
+    bool await_ready() noexcept {
+      if (printer.held)
+        return false;
+      printer.held = true;
+      return true;
+    }
+    void await_suspend(std::coroutine_handle<> h) noexcept {
+      node = {h, nullptr};
+      if (printer.tail)
+        printer.tail->next = &node;
+      else
+        printer.head = &node;
+      printer.tail = &node;
+    }
+    Job await_resume() noexcept { return Job(&printer); }
+  };
+  return Acquire{*this, {}};
+}
+
+} // namespace kp347
+
+#endif // KP347_PRINTER_HPP
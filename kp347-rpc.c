@@ -0,0 +1,679 @@
+/*!
+ * @file kp347-rpc.c
+ *
+ * Host protocol for the printer library; see kp347-rpc.h for the frame
+ * layout.  Frames are assembled byte by byte from KP347_STREAM_READ()
+ * without blocking, checked, then run against the public API.
+ */
+
+#include "kp347-rpc.h"
+
+#ifndef KP347_STREAM_WRITE
+#error "kp347-rpc needs KP347_STREAM_WRITE(data) on the host link in port.h"
+#endif
+
+#define RPC_MAX_REPLY 64 //!< Reply payload buffer, status and results
+// Longest gap allowed between bytes of one frame, in microseconds.  A frame
+// cut short (or a damaged length) is dropped and the receiver looks for
+// RPC_SYNC again instead of waiting out up to 64K bytes that never come.
+#define RPC_BYTE_TIMEOUT 100000L
+
+// Frame receiver states
+enum {
+  RX_SYNC,
+  RX_SEQ,
+  RX_LEN_LO,
+  RX_LEN_HI,
+  RX_PAYLOAD,
+  RX_SKIP, // Oversized payload, consumed but not stored
+  RX_CRC_LO,
+  RX_CRC_HI,
+};
+
+static uint8_t rxState, rxSeq, rxStatus;
+static uint16_t rxLen, rxCount, rxCrc, rxFrameCrc;
+static unsigned long rxTime; // When the last frame byte arrived
+static uint8_t payload[RPC_MAX_PAYLOAD];
+
+static uint8_t reply[RPC_MAX_REPLY]; // Kept so a repeated seq can be answered
+static uint16_t replyLen;
+static uint8_t replySeq;
+static bool replyValid;
+
+static const uint8_t *args, *argsEnd; // Call arguments being parsed
+#if KP347_ASSETS
+static const uint8_t *bundle;
+#endif
+static char text[256]; // NUL-terminated copies of str arguments
+
+// Chunked image transfer state
+static uint16_t imageWidth, imageHeight, imageRows; // imageRows = rows printed
+static uint16_t imageNext; // Next chunk to print
+static bool imageActive;
+static uint8_t imageHeld[RPC_IMAGE_WINDOW][RPC_IMAGE_CHUNK_MAX];
+static uint16_t imageHeldLen[RPC_IMAGE_WINDOW]; // 0 = slot empty
+
+uint16_t rpcCrc(uint16_t crc, uint8_t b) {
+  crc ^= (uint16_t)b << 8;
+  for (uint8_t i = 0; i < 8; i++)
+    crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+  return crc;
+}
+
+#if KP347_ASSETS
+void rpcSetBundle(const uint8_t *b) { bundle = b; }
+#endif
+
+static bool need(uint16_t n) { return (uint16_t)(argsEnd - args) >= n; }
+
+static uint8_t get8() { return *args++; }
+
+static uint16_t get16() {
+  uint16_t v = args[0] | (args[1] << 8);
+  args += 2;
+  return v;
+}
+
+static uint32_t get32() {
+  uint32_t v = args[0] | (args[1] << 8) | ((uint32_t)args[2] << 16) |
+               ((uint32_t)args[3] << 24);
+  args += 4;
+  return v;
+}
+
+static void put8(uint8_t v) { reply[replyLen++] = v; }
+
+static void put16(uint16_t v) {
+  put8(v);
+  put8(v >> 8);
+}
+
+static void put32(uint32_t v) {
+  put16(v);
+  put16(v >> 16);
+}
+
+// Copy a str argument into text at offset, NUL-terminated.  Returns the
+// copy, or NULL if the argument is truncated or doesn't fit.
+static const char *getString(uint16_t offset) {
+  uint8_t n;
+
+  if (!need(1))
+    return NULL;
+  n = get8();
+  if (!need(n) || (offset + n >= sizeof(text)))
+    return NULL;
+  memcpy(text + offset, args, n);
+  text[offset + n] = 0;
+  args += n;
+  return text + offset;
+}
+
+// Print one chunk of whole rows, clipped to the announced image height.
+static void printChunk(const uint8_t *data, uint16_t len) {
+  uint16_t rowBytes = (imageWidth + 7) / 8, rows = len / rowBytes;
+
+  if (rows > imageHeight - imageRows)
+    rows = imageHeight - imageRows;
+  if (rows)
+    printBitmapFromBitMap(imageWidth, rows, data, false);
+  imageRows += rows;
+  imageNext++;
+  if (imageRows >= imageHeight)
+    imageActive = false;
+}
+
+// Accept chunk n: print it if it is next (then anything held after it),
+// hold it if it is within the window ahead, otherwise drop it.
+static void imageChunk(uint16_t n, const uint8_t *data, uint16_t len) {
+  uint16_t ahead = n - imageNext, i;
+
+  if (n == imageNext) {
+    printChunk(data, len);
+    // Slot i holds chunk imageNext + 1 + i; shift the window along
+    while (imageActive && imageHeldLen[0]) {
+      printChunk(imageHeld[0], imageHeldLen[0]);
+      for (i = 1; i < RPC_IMAGE_WINDOW; i++) {
+        memcpy(imageHeld[i - 1], imageHeld[i], imageHeldLen[i]);
+        imageHeldLen[i - 1] = imageHeldLen[i];
+      }
+      imageHeldLen[RPC_IMAGE_WINDOW - 1] = 0;
+    }
+    if (!imageActive) {
+      for (i = 0; i < RPC_IMAGE_WINDOW; i++)
+        imageHeldLen[i] = 0;
+    }
+  } else if ((ahead >= 1) && (ahead <= RPC_IMAGE_WINDOW)) {
+    memcpy(imageHeld[ahead - 1], data, len);
+    imageHeldLen[ahead - 1] = len;
+  }
+}
+
+static uint8_t imageHeldMask() {
+  uint8_t mask = 0, i;
+  for (i = 0; i < RPC_IMAGE_WINDOW; i++) {
+    if (imageHeldLen[i])
+      mask |= 1 << i;
+  }
+  return mask;
+}
+
+// Run one call.  Returns RPC_OK or the error that stops the frame.
+static uint8_t runCall(uint8_t op) {
+  uint16_t w, h, len;
+  uint8_t i, n;
+
+  switch (op) {
+  case RPC_NOP:
+    break;
+  case RPC_WRITE:
+    if (!need(1))
+      return RPC_ERR_ARGS;
+    n = get8();
+    if (!need(n))
+      return RPC_ERR_ARGS;
+    while (n--)
+      write(get8());
+    break;
+  case RPC_BEGIN:
+    if (!need(2))
+      return RPC_ERR_ARGS;
+    begin(get16());
+    break;
+  case RPC_FEED:
+  case RPC_FEED_ROWS:
+  case RPC_JUSTIFY:
+#if KP347_BARCODE
+  case RPC_SET_BARCODE_HEIGHT:
+#endif
+  case RPC_SET_FONT:
+  case RPC_SET_CHAR_SPACING:
+#if KP347_CHARSET
+  case RPC_SET_CHARSET:
+  case RPC_SET_CODE_PAGE:
+#endif
+  case RPC_SET_LINE_HEIGHT:
+  case RPC_SET_MAX_CHUNK_HEIGHT:
+  case RPC_SET_SIZE:
+  case RPC_UNDERLINE:
+#if KP347_CUTTER
+  case RPC_CUT:
+#endif
+#if KP347_DRAFT
+  case RPC_SET_DRAFT_MODE:
+#endif
+  case RPC_BOLD:
+  case RPC_DOUBLE_HEIGHT:
+  case RPC_DOUBLE_WIDTH:
+  case RPC_INVERSE:
+  case RPC_ONLINE:
+  case RPC_STRIKE:
+  case RPC_UPSIDE_DOWN:
+    if (!need(1))
+      return RPC_ERR_ARGS;
+    n = get8();
+    switch (op) {
+    case RPC_FEED:
+      feed(n);
+      break;
+    case RPC_FEED_ROWS:
+      feedRows(n);
+      break;
+    case RPC_JUSTIFY:
+      justify(n);
+      break;
+#if KP347_BARCODE
+    case RPC_SET_BARCODE_HEIGHT:
+      setBarcodeHeight(n);
+      break;
+#endif
+    case RPC_SET_FONT:
+      setFont(n);
+      break;
+    case RPC_SET_CHAR_SPACING:
+      setCharSpacing(n);
+      break;
+#if KP347_CHARSET
+    case RPC_SET_CHARSET:
+      setCharset(n);
+      break;
+    case RPC_SET_CODE_PAGE:
+      setCodePage(n);
+      break;
+#endif
+    case RPC_SET_LINE_HEIGHT:
+      setLineHeight(n);
+      break;
+    case RPC_SET_MAX_CHUNK_HEIGHT:
+      setMaxChunkHeight(n);
+      break;
+    case RPC_SET_SIZE:
+      setSize(n);
+      break;
+    case RPC_UNDERLINE:
+      if (n)
+        underlineOn(n);
+      else
+        underlineOff();
+      break;
+#if KP347_CUTTER
+    case RPC_CUT:
+      cut(n);
+      break;
+#endif
+#if KP347_DRAFT
+    case RPC_SET_DRAFT_MODE:
+      setDraftMode(n);
+      break;
+#endif
+    case RPC_BOLD:
+      n ? boldOn() : boldOff();
+      break;
+    case RPC_DOUBLE_HEIGHT:
+      n ? doubleHeightOn() : doubleHeightOff();
+      break;
+    case RPC_DOUBLE_WIDTH:
+      n ? doubleWidthOn() : doubleWidthOff();
+      break;
+    case RPC_INVERSE:
+      n ? inverseOn() : inverseOff();
+      break;
+    case RPC_ONLINE:
+      n ? online() : offline();
+      break;
+    case RPC_STRIKE:
+      n ? strikeOn() : strikeOff();
+      break;
+    case RPC_UPSIDE_DOWN:
+      n ? upsideDownOn() : upsideDownOff();
+      break;
+    }
+    break;
+  case RPC_FLUSH:
+    flush();
+    break;
+#if KP347_BARCODE
+  case RPC_PRINT_BARCODE: {
+    const char *s;
+    if (!need(1))
+      return RPC_ERR_ARGS;
+    n = get8();
+    if (!(s = getString(0)))
+      return RPC_ERR_ARGS;
+    printBarcode(s, n);
+    break;
+  }
+#endif
+  case RPC_PRINT_BITMAP:
+#if KP347_COLUMN_BITMAPS
+  case RPC_PRINT_BITMAP_COLUMNS:
+#endif
+    if (!need(6))
+      return RPC_ERR_ARGS;
+    w = get16();
+    h = get16();
+    len = get16();
+    if ((w == 0) || (h == 0) || !need(len) ||
+        ((uint32_t)len < (uint32_t)((w + 7) / 8) * h))
+      return RPC_ERR_ARGS;
+#if KP347_COLUMN_BITMAPS
+    if (op == RPC_PRINT_BITMAP_COLUMNS)
+      printBitmapColumns(w, h, args, false);
+    else
+#endif
+      printBitmapFromBitMap(w, h, args, false);
+    args += len;
+    break;
+  case RPC_NORMAL:
+    normal();
+    break;
+  case RPC_RESET:
+    reset();
+    break;
+  case RPC_SET_DEFAULT:
+    setDefault();
+    break;
+  case RPC_SET_TIMES: {
+    unsigned long p;
+    if (!need(8))
+      return RPC_ERR_ARGS;
+    p = get32();
+    setTimes(p, get32());
+    break;
+  }
+  case RPC_SET_HEAT_CONFIG:
+    if (!need(3))
+      return RPC_ERR_ARGS;
+    n = get8();
+    i = get8();
+    setHeatConfig(n, i, get8());
+    break;
+  case RPC_SET_PRINT_DENSITY:
+    if (!need(2))
+      return RPC_ERR_ARGS;
+    n = get8();
+    setPrintDensity(n, get8());
+    break;
+#if KP347_SLEEP
+  case RPC_SLEEP_AFTER:
+    if (!need(2))
+      return RPC_ERR_ARGS;
+    sleepAfter(get16());
+    break;
+#endif
+  case RPC_TAB:
+    tab();
+    break;
+  case RPC_TEST:
+    test();
+    break;
+  case RPC_TEST_PAGE:
+    testPage();
+    break;
+  case RPC_TIMEOUT_SET:
+    if (!need(4))
+      return RPC_ERR_ARGS;
+    timeoutSet(get32());
+    break;
+  case RPC_TIMEOUT_WAIT:
+    timeoutWait();
+    break;
+  case RPC_WAKE:
+    wake();
+    break;
+  case RPC_HAS_PAPER:
+    if (replyLen + 1 > RPC_MAX_REPLY)
+      return RPC_ERR_REPLY;
+    put8(hasPaper());
+    break;
+#if KP347_TABLE
+  case RPC_TABLE_BEGIN: {
+    struct tableColumn cols[TABLE_MAX_COLUMNS];
+    if (!need(1))
+      return RPC_ERR_ARGS;
+    n = get8();
+    if ((n > TABLE_MAX_COLUMNS) || !need(4 * n))
+      return RPC_ERR_ARGS;
+    for (i = 0; i < n; i++) {
+      cols[i].width = get8();
+      cols[i].percent = get8();
+      cols[i].align = get8();
+      cols[i].wrap = get8();
+    }
+    tableBegin(cols, n);
+    break;
+  }
+  case RPC_TABLE_ROW: {
+    const char *cells[TABLE_MAX_COLUMNS];
+    uint16_t offset = 0;
+    if (!need(1))
+      return RPC_ERR_ARGS;
+    n = get8();
+    if (n > TABLE_MAX_COLUMNS)
+      return RPC_ERR_ARGS;
+    for (i = 0; i < TABLE_MAX_COLUMNS; i++)
+      cells[i] = NULL;
+    for (i = 0; i < n; i++) {
+      if (!(cells[i] = getString(offset)))
+        return RPC_ERR_ARGS;
+      offset += strlen(cells[i]) + 1;
+    }
+    tableRow(cells);
+    break;
+  }
+#endif
+#if KP347_ASSETS
+  case RPC_PRINT_ASSET: {
+    const struct assetEntry *asset;
+    if (!need(2))
+      return RPC_ERR_ARGS;
+    w = get16();
+    if (!bundle || !(asset = assetFindId(bundle, w)))
+      return RPC_ERR_STATE;
+    printAsset(bundle, asset);
+    break;
+  }
+#endif
+#if KP347_AUTODETECT
+  case RPC_DETECT_FIRMWARE:
+    if (replyLen + 2 > RPC_MAX_REPLY)
+      return RPC_ERR_REPLY;
+    put16(detectFirmware());
+    break;
+#endif
+  case RPC_SET_PROFILE: {
+    struct printerProfile profile = {0}; // No mode costs; see RPC_SET_MODE_COST
+    if (!need(16))
+      return RPC_ERR_ARGS;
+    profile.firmware = get16();
+    profile.dotPrintTime = get32();
+    profile.dotFeedTime = get32();
+    profile.cutterOffset = get8();
+    profile.cutTime = get32();
+    profile.columnBitmaps = get8();
+    setProfile(&profile);
+    break;
+  }
+#if KP347_CUTTER
+  case RPC_SET_CUT_TIME:
+    if (!need(4))
+      return RPC_ERR_ARGS;
+    setCutTime(get32());
+    break;
+  case RPC_MEASURE_CUT_TIME:
+    if (!need(1))
+      return RPC_ERR_ARGS;
+    if (replyLen + 4 > RPC_MAX_REPLY)
+      return RPC_ERR_REPLY;
+    put32(measureCutTime(get8()));
+    break;
+#endif
+  case RPC_IMAGE_BEGIN:
+    if (!need(5))
+      return RPC_ERR_ARGS;
+    if (replyLen + 2 > RPC_MAX_REPLY)
+      return RPC_ERR_REPLY;
+    w = get16();
+    h = get16();
+    n = get8();
+    if ((w == 0) || ((w + 7) / 8 > RPC_IMAGE_CHUNK_MAX))
+      return RPC_ERR_ARGS;
+    if (!(n && imageActive && (w == imageWidth) && (h == imageHeight))) {
+      imageWidth = w;
+      imageHeight = h;
+      imageRows = 0;
+      imageNext = 0;
+      imageActive = (h > 0);
+      for (i = 0; i < RPC_IMAGE_WINDOW; i++)
+        imageHeldLen[i] = 0;
+    }
+    put16(imageNext);
+    break;
+  case RPC_IMAGE_CHUNK:
+    if (!need(4))
+      return RPC_ERR_ARGS;
+    if (replyLen + 3 > RPC_MAX_REPLY)
+      return RPC_ERR_REPLY;
+    w = get16();
+    len = get16();
+    if (!need(len))
+      return RPC_ERR_ARGS;
+    if (!imageActive)
+      return RPC_ERR_STATE;
+    if ((len == 0) || (len > RPC_IMAGE_CHUNK_MAX) ||
+        (len % ((imageWidth + 7) / 8)))
+      return RPC_ERR_ARGS;
+    imageChunk(w, args, len);
+    args += len;
+    put16(imageNext);
+    put8(imageHeldMask());
+    break;
+  case RPC_SET_MODE_COST:
+    if (!need(2))
+      return RPC_ERR_ARGS;
+    n = get8();
+    setModeCost(n, get8());
+    break;
+  case RPC_IMAGE_ABORT:
+    imageActive = false;
+    for (i = 0; i < RPC_IMAGE_WINDOW; i++)
+      imageHeldLen[i] = 0;
+    break;
+#if KP347_PROBE
+  case RPC_PROBE_BUFFER: {
+    struct bufferProbe probe;
+    if (!need(2))
+      return RPC_ERR_ARGS;
+    if (replyLen + 8 > RPC_MAX_REPLY)
+      return RPC_ERR_REPLY;
+    if (!probeBuffer(get16(), &probe, NULL))
+      return RPC_ERR_STATE; // Printer doesn't answer status queries
+    put16(probe.capacity);
+    put16(probe.dropAt);
+    put32(probe.drainTime);
+    break;
+  }
+  case RPC_TUNE_PROFILE: {
+    struct printerProfile profile = {0};
+    if (!need(1))
+      return RPC_ERR_ARGS;
+    if (replyLen + 8 + MODE_COSTS > RPC_MAX_REPLY)
+      return RPC_ERR_REPLY;
+    if (!tuneProfile(&profile, get8()))
+      return RPC_ERR_STATE; // Printer doesn't answer status queries
+    put32(profile.dotPrintTime);
+    put32(profile.dotFeedTime);
+    for (i = 0; i < MODE_COSTS; i++)
+      put8(profile.modeCost[i]);
+    break;
+  }
+#endif
+#if KP347_CYCLES
+  case RPC_CYCLE_COUNTS: {
+    const struct cycleCount *counts = cycleCounts();
+    if (!need(1))
+      return RPC_ERR_ARGS;
+    if (replyLen + 12 * CYCLE_REGIONS > RPC_MAX_REPLY)
+      return RPC_ERR_REPLY;
+    for (i = 0; i < CYCLE_REGIONS; i++) {
+      put32(counts[i].calls);
+      put32(counts[i].cycles);
+      put32(counts[i].cycles >> 32);
+    }
+    if (get8())
+      cycleCountsReset();
+    break;
+  }
+#endif
+  default:
+    return RPC_ERR_OPCODE;
+  }
+  return RPC_OK;
+}
+
+static void sendReply() {
+  uint16_t crc = 0xFFFF, i;
+
+  KP347_STREAM_WRITE(RPC_SYNC);
+  KP347_STREAM_WRITE(replySeq);
+  KP347_STREAM_WRITE(replyLen);
+  KP347_STREAM_WRITE(replyLen >> 8);
+  crc = rpcCrc(crc, replySeq);
+  crc = rpcCrc(crc, replyLen);
+  crc = rpcCrc(crc, replyLen >> 8);
+  for (i = 0; i < replyLen; i++) {
+    KP347_STREAM_WRITE(reply[i]);
+    crc = rpcCrc(crc, reply[i]);
+  }
+  KP347_STREAM_WRITE(crc);
+  KP347_STREAM_WRITE(crc >> 8);
+}
+
+// A complete frame has arrived; run it unless it is a resend.
+static void runFrame() {
+  uint8_t status = rxStatus, calls = 0;
+
+  if ((status == RPC_OK) && (rxCrc != rxFrameCrc))
+    status = RPC_ERR_CRC;
+
+  if ((status == RPC_OK) && replyValid && (rxSeq == replySeq)) {
+    sendReply(); // Our reply got lost; don't print twice
+    return;
+  }
+
+  replySeq = rxSeq;
+  replyLen = 2; // Status and call count go first
+  if (status == RPC_OK) {
+    args = payload;
+    argsEnd = payload + rxLen;
+    while (args < argsEnd) {
+      if (calls == RPC_MAX_CALLS) {
+        status = RPC_ERR_ARGS; // Their count must fit its byte
+        break;
+      }
+      if ((status = runCall(get8())) != RPC_OK)
+        break;
+      calls++;
+    }
+  }
+  reply[0] = status;
+  reply[1] = calls;
+  // Damaged frames must not block a resend with the same seq; anything
+  // that ran calls is kept, so a resend is answered, not printed again
+  replyValid = (status != RPC_ERR_CRC) && (status != RPC_ERR_LENGTH);
+  sendReply();
+}
+
+void rpcPoll() {
+  int c;
+
+  while ((c = KP347_STREAM_READ()) >= 0) {
+    if ((rxState != RX_SYNC) &&
+        (KP347_TIME_DIFF(micros(), rxTime) >= RPC_BYTE_TIMEOUT))
+      rxState = RX_SYNC; // Rest of the frame never came
+    rxTime = micros();
+    if ((rxState >= RX_LEN_LO) && (rxState <= RX_SKIP))
+      rxCrc = rpcCrc(rxCrc, c);
+
+    switch (rxState) {
+    case RX_SYNC:
+      if (c == RPC_SYNC)
+        rxState = RX_SEQ;
+      break;
+    case RX_SEQ:
+      rxSeq = c;
+      rxCrc = rpcCrc(0xFFFF, c);
+      rxState = RX_LEN_LO;
+      break;
+    case RX_LEN_LO:
+      rxLen = c;
+      rxState = RX_LEN_HI;
+      break;
+    case RX_LEN_HI:
+      rxLen |= c << 8;
+      rxCount = 0;
+      rxStatus = (rxLen > RPC_MAX_PAYLOAD) ? RPC_ERR_LENGTH : RPC_OK;
+      if (rxLen == 0)
+        rxState = RX_CRC_LO;
+      else
+        rxState = (rxStatus == RPC_OK) ? RX_PAYLOAD : RX_SKIP;
+      break;
+    case RX_PAYLOAD:
+    case RX_SKIP:
+      if (rxState == RX_PAYLOAD)
+        payload[rxCount] = c;
+      if (++rxCount == rxLen)
+        rxState = RX_CRC_LO;
+      break;
+    case RX_CRC_LO:
+      rxFrameCrc = c;
+      rxState = RX_CRC_HI;
+      break;
+    case RX_CRC_HI:
+      rxFrameCrc |= c << 8;
+      rxState = RX_SYNC;
+      runFrame();
+      break;
+    }
+  }
+}
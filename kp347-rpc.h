@@ -0,0 +1,161 @@
+/*!
+ * @file kp347-rpc.h
+ *
+ * Framed binary protocol that lets a host drive the printer API through
+ * the MCU's host stream (KP347_STREAM_READ / KP347_STREAM_WRITE).
+ *
+ * Request and reply frames share one layout, all fields little-endian:
+ *
+ *   RPC_SYNC  seq  len(2)  payload[len]  crc(2)
+ *
+ * crc is CRC-16/CCITT-FALSE over seq, len and payload.  A request payload
+ * is a sequence of calls, each an opcode from rpcOpcodes followed by its
+ * arguments as listed there, so a whole receipt can go in one frame.  The
+ * calls run in order; the reply carries the same seq and the payload
+ *
+ *   status  calls_run  results...
+ *
+ * where results are the return values of the calls that have one, in
+ * call order.  calls_run is a byte, so a frame runs at most RPC_MAX_CALLS
+ * calls; the rest answer RPC_ERR_ARGS and go in the next frame.  A request repeating the previous seq is not run again,
+ * the previous reply is re-sent instead, so the host can simply resend
+ * a frame whose reply was lost.
+ *
+ * Large images go as numbered chunks of whole rows (RPC_IMAGE_*), best
+ * one chunk per frame so the frame CRC covers exactly one chunk.  Each
+ * reply names the next chunk the printer needs and, as a bit mask, which
+ * later chunks are already held (bit i for chunk next + 1 + i, up to
+ * RPC_IMAGE_WINDOW), so the host resends only chunks that were damaged or
+ * lost, and keeps no more than RPC_IMAGE_WINDOW chunks in flight past the
+ * next one.  Chunks are printed in
+ * order as soon as they are complete.  After a link drop, RPC_IMAGE_BEGIN
+ * with resume set and the same size picks the transfer up where it
+ * stopped instead of starting over.
+ */
+
+#ifndef KP347_RPC_H
+#define KP347_RPC_H
+
+#include "kp347-printer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RPC_SYNC 0xA5       //!< First byte of every frame
+#define RPC_MAX_PAYLOAD 512 //!< Largest payload accepted, in bytes
+#define RPC_MAX_CALLS 255   //!< Most calls run from one frame (calls_run)
+#define RPC_IMAGE_CHUNK_MAX 384 //!< Largest image chunk, in bytes (whole rows)
+#ifndef RPC_IMAGE_WINDOW
+// Out-of-order image chunks held for reordering, RPC_IMAGE_CHUNK_MAX bytes
+// of RAM each.  A lost chunk costs one resend as long as the chunks the
+// host has in flight after it fit in the window.
+#define RPC_IMAGE_WINDOW 4
+#endif
+#if (RPC_IMAGE_WINDOW < 1) || (RPC_IMAGE_WINDOW > 8)
+#error "RPC_IMAGE_WINDOW must be 1 to 8, the bits of the held mask"
+#endif
+
+/*!
+ * Reply status codes
+ */
+enum rpcStatus {
+  RPC_OK,          /**< All calls ran */
+  RPC_ERR_CRC,     /**< Frame damaged, nothing ran; resend it */
+  RPC_ERR_LENGTH,  /**< Payload longer than RPC_MAX_PAYLOAD, nothing ran */
+  RPC_ERR_OPCODE,  /**< Unknown or compiled-out opcode; calls before it ran */
+  RPC_ERR_ARGS,    /**< Payload ended inside a call, a call's arguments
+                        were invalid, or it held more than RPC_MAX_CALLS
+                        calls; calls before it ran */
+  RPC_ERR_STATE,   /**< Call not possible now (e.g. no bundle); earlier ones ran */
+  RPC_ERR_REPLY,   /**< Results would overflow the reply; calls before it ran */
+};
+
+/*!
+ * Call opcodes.  Arguments follow in the order given; str is a length
+ * byte followed by that many bytes, data is a 16-bit length followed by
+ * that many bytes.  Results are listed after "->".
+ */
+enum rpcOpcodes {
+  RPC_NOP,                  /**< (none) */
+  RPC_WRITE,                /**< str: bytes issued through write() */
+  RPC_BEGIN,                /**< u16 version */
+  RPC_BOLD,                 /**< u8 on */
+  RPC_DOUBLE_HEIGHT,        /**< u8 on */
+  RPC_DOUBLE_WIDTH,         /**< u8 on */
+  RPC_FEED,                 /**< u8 lines */
+  RPC_FEED_ROWS,            /**< u8 rows */
+  RPC_FLUSH,                /**< (none) */
+  RPC_INVERSE,              /**< u8 on */
+  RPC_JUSTIFY,              /**< u8 'L', 'C' or 'R' */
+  RPC_ONLINE,               /**< u8 on (0 = offline()) */
+  RPC_PRINT_BARCODE,        /**< u8 type, str text */
+  RPC_PRINT_BITMAP,         /**< u16 w, u16 h, data rows */
+  RPC_PRINT_BITMAP_COLUMNS, /**< u16 w, u16 h, data rows */
+  RPC_NORMAL,               /**< (none) */
+  RPC_RESET,                /**< (none) */
+  RPC_SET_BARCODE_HEIGHT,   /**< u8 height */
+  RPC_SET_FONT,             /**< u8 'A' or 'B' */
+  RPC_SET_CHAR_SPACING,     /**< u8 spacing */
+  RPC_SET_CHARSET,          /**< u8 charset */
+  RPC_SET_CODE_PAGE,        /**< u8 code page */
+  RPC_SET_DEFAULT,          /**< (none) */
+  RPC_SET_LINE_HEIGHT,      /**< u8 height */
+  RPC_SET_MAX_CHUNK_HEIGHT, /**< u8 rows */
+  RPC_SET_SIZE,             /**< u8 'S', 'M' or 'L' */
+  RPC_SET_TIMES,            /**< u32 print, u32 feed */
+  RPC_SET_HEAT_CONFIG,      /**< u8 dots, u8 time, u8 interval */
+  RPC_SET_PRINT_DENSITY,    /**< u8 density, u8 break time */
+  RPC_SLEEP_AFTER,          /**< u16 seconds (1 = sleep()) */
+  RPC_STRIKE,               /**< u8 on */
+  RPC_TAB,                  /**< (none) */
+  RPC_TEST,                 /**< (none) */
+  RPC_TEST_PAGE,            /**< (none) */
+  RPC_TIMEOUT_SET,          /**< u32 microseconds */
+  RPC_TIMEOUT_WAIT,         /**< (none) */
+  RPC_UNDERLINE,            /**< u8 weight (0 = off) */
+  RPC_UPSIDE_DOWN,          /**< u8 on */
+  RPC_WAKE,                 /**< (none) */
+  RPC_HAS_PAPER,            /**< -> u8 paper */
+  RPC_TABLE_BEGIN,          /**< u8 count, count x (u8 width, u8 percent, u8 align, u8 wrap) */
+  RPC_TABLE_ROW,            /**< u8 count, count x str */
+  RPC_PRINT_ASSET,          /**< u16 id, from the bundle given to rpcSetBundle() */
+  RPC_DETECT_FIRMWARE,      /**< -> u16 version */
+  RPC_SET_PROFILE,          /**< u16 firmware, u32 print, u32 feed, u8 cutter offset, u32 cut time, u8 columns */
+  RPC_CUT,                  /**< u8 partial */
+  RPC_SET_CUT_TIME,         /**< u32 microseconds */
+  RPC_MEASURE_CUT_TIME,     /**< u8 partial -> u32 microseconds */
+  RPC_SET_DRAFT_MODE,       /**< u8 on */
+  RPC_IMAGE_BEGIN,          /**< u16 w, u16 h, u8 resume -> u16 next chunk */
+  RPC_IMAGE_CHUNK,          /**< u16 chunk, data rows -> u16 next chunk, u8 held */
+  RPC_IMAGE_ABORT,          /**< (none) */
+  RPC_SET_MODE_COST,        /**< u8 mode (modeCosts), u8 percent */
+  RPC_PROBE_BUFFER,         /**< u16 max bytes -> u16 capacity, u16 drop at, u32 drain time */
+  RPC_TUNE_PROFILE,         /**< u8 safety percent -> u32 print, u32 feed, u8 x MODE_COSTS mode costs */
+  RPC_CYCLE_COUNTS,         /**< u8 reset -> CYCLE_REGIONS x (u32 calls, u32 cycles low, u32 cycles high) */
+};
+
+/*!
+  * @brief Handles whatever the host has sent so far; call from the main loop
+  */
+void rpcPoll();
+#if KP347_ASSETS
+/*!
+  * @brief Sets the asset bundle RPC_PRINT_ASSET prints from
+  * @param bundle Start of a valid bundle, or NULL
+  */
+void rpcSetBundle(const uint8_t *bundle);
+#endif
+/*!
+  * @brief CRC-16/CCITT-FALSE step, as used for frames
+  * @param crc CRC so far, 0xFFFF to start
+  * @param b Next byte
+  * @return Returns the updated CRC
+  */
+uint16_t rpcCrc(uint16_t crc, uint8_t b);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // KP347_RPC_H
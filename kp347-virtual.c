@@ -0,0 +1,669 @@
+/*!
+ * @file kp347-virtual.c
+ *
+ * Virtual printer; see kp347-virtual.h.  It knows the commands this
+ * library sends, in the form begin()'s firmware version selects, and
+ * times them the way the pacing engine assumes the printer does: a
+ * command is taken from the input buffer once it has arrived and the
+ * mechanism is done with the one before.
+ */
+
+#include "kp347-virtual.h"
+
+#if KP347_VIRTUAL
+
+#define ASCII_TAB '\t' //!< Horizontal tab
+#define ASCII_LF '\n'  //!< Line feed
+#define ASCII_DC2 18   //!< Device control 2
+#define ASCII_ESC 27   //!< Escape
+#define ASCII_GS 29    //!< Group separator
+
+#define FONT_MASK (1 << 0)          //!< Font B
+#define INVERSE_MASK (1 << 1)       //!< White on black
+#define UPDOWN_MASK (1 << 2)        //!< Upside-down lines
+#define BOLD_MASK (1 << 3)          //!< Bold text
+#define DOUBLE_HEIGHT_MASK (1 << 4) //!< Double-height text
+#define DOUBLE_WIDTH_MASK (1 << 5)  //!< Double-width text
+#define STRIKE_MASK (1 << 6)        //!< Struck-through text
+
+#define LINE_DOTS (VIRTUAL_ROW_BYTES * 8) //!< Dots per row
+
+#define VIRTUAL_FIRMWARE 268 //!< Firmware of a profile for any version (0)
+
+// Same as the library's built-in profile (kp347-printer.c), which applies
+// from firmware 0 up; the printer runs VIRTUAL_FIRMWARE under it
+static const struct printerProfile virtualDefault = {
+    0, 30000, 2100, 96, 500000L, false, {0, 0, 0, 0}, 0};
+
+// Firmware version the printer runs
+static uint16_t firmwareOf(const struct virtualPrinter *vp) {
+  return vp->profile->firmware ? vp->profile->firmware : VIRTUAL_FIRMWARE;
+}
+
+// What ESC @ restores
+static void resetModes(struct virtualPrinter *vp) {
+  vp->printMode = 0;
+  vp->lineHeight = 30;
+  vp->barcodeHeight = 50;
+  vp->inverse = vp->upsideDown = vp->underline = vp->justify = 0;
+  vp->charSpacing = vp->charset = vp->codePage = 0;
+  vp->barcodeWidth = 3;
+  vp->barcodeLabel = 0;
+}
+
+void virtualBegin(struct virtualPrinter *vp,
+                  const struct printerProfile *profile,
+                  unsigned long byteTime) {
+  unsigned long now = micros();
+
+  vp->profile = profile ? profile : &virtualDefault;
+  vp->byteTime = byteTime;
+  memset(&vp->stats, 0, sizeof(vp->stats));
+  vp->stats.pageHash = 2166136261UL;
+  vp->head = vp->count = 0;
+  vp->linkFree = vp->busyUntil = now;
+  vp->reloadAt = 0;
+  vp->replyHead = vp->replyCount = 0;
+  vp->cmdLen = vp->cmdNeed = 0;
+  vp->dataLeft = 0;
+  vp->dataToNul = vp->lengthNext = false;
+  resetModes(vp);
+  vp->lineRows = 0;
+  vp->column = vp->lineWidth = 0;
+  memset(vp->line, 0, sizeof(vp->line));
+  memset(vp->row, 0, sizeof(vp->row));
+  vp->bootDone = now + vp->faults.bootTime;
+  vp->booting = vp->faults.bootTime != 0;
+  vp->random = vp->faults.seed ? vp->faults.seed : 1;
+  vp->paperOut = vp->coverDone = vp->coverReport = false;
+}
+
+// xorshift32: 16 fresh bits per received byte
+static uint16_t nextRandom(struct virtualPrinter *vp) {
+  vp->random ^= vp->random << 13;
+  vp->random ^= vp->random >> 17;
+  vp->random ^= vp->random << 5;
+  return vp->random >> 16;
+}
+
+static void queueReply(struct virtualPrinter *vp, uint8_t c, unsigned long at) {
+  uint8_t i;
+
+  if (vp->replyCount == VIRTUAL_REPLIES)
+    return; // Nobody is reading
+  i = (vp->replyHead + vp->replyCount++) % VIRTUAL_REPLIES;
+  vp->reply[i] = c;
+  vp->replyDue[i] = at + vp->faults.statusDelay;
+}
+
+static void reload(struct virtualPrinter *vp, unsigned long at) {
+  vp->paperOut = false;
+  vp->reloadAt = 0;
+  vp->stats.clearTime = at;
+}
+
+static uint8_t charHeight(struct virtualPrinter *vp) {
+  uint8_t h = (vp->printMode & FONT_MASK) ? 17 : 24;
+  return (vp->printMode & DOUBLE_HEIGHT_MASK) ? h * 2 : h;
+}
+
+static uint8_t charWidth(struct virtualPrinter *vp) {
+  uint8_t w = (vp->printMode & FONT_MASK) ? 9 : 12;
+  return (vp->printMode & DOUBLE_WIDTH_MASK) ? w * 2 : w;
+}
+
+// Runs the mechanism from time at: printRows rows printed, feedRows fed,
+// then extra microseconds (the cutter).  Paper and cover faults strike
+// here, since they are scripted by dot row.
+static void mechanism(struct virtualPrinter *vp, unsigned long at,
+                      unsigned long printRows, unsigned long feedRows,
+                      unsigned long extra) {
+  struct virtualStats *s = &vp->stats;
+  const struct printerProfile *p = vp->profile;
+  unsigned long used = s->rowsPrinted + s->rowsFed, left;
+
+  if (KP347_TIME_DIFF(vp->busyUntil, at) > 0)
+    at = vp->busyUntil; // After the previous step of the same command
+  if (vp->paperOut) {
+    s->rowsLost += printRows + feedRows;
+    return; // Nothing moves without paper
+  }
+  if (vp->faults.paperOutRow &&
+      (used + printRows + feedRows >= vp->faults.paperOutRow)) {
+    left = vp->faults.paperOutRow - used; // Rows still on the roll
+    if (printRows > left) {
+      s->rowsLost += printRows - left + feedRows;
+      printRows = left;
+      feedRows = 0;
+    } else {
+      s->rowsLost += feedRows - (left - printRows);
+      feedRows = left - printRows;
+    }
+    vp->paperOut = true;
+    vp->faults.paperOutRow = 0; // Once
+    s->faultTime = at;
+    s->reportTime = s->clearTime = s->printAgainTime = 0;
+    if (vp->faults.reloadTime)
+      vp->reloadAt = at + vp->faults.reloadTime;
+  }
+  if (printRows && s->clearTime && !s->printAgainTime)
+    s->printAgainTime = at;
+  s->rowsPrinted += printRows;
+  s->rowsFed += feedRows;
+  vp->busyUntil =
+      at + (printRows * p->dotPrintTime + feedRows * p->dotFeedTime + extra) *
+               (100 + vp->faults.slowPercent) / 100;
+
+  if (vp->faults.coverOpenRow && !vp->coverDone &&
+      (s->rowsPrinted + s->rowsFed >= vp->faults.coverOpenRow)) {
+    vp->coverDone = true;
+    s->faultTime = vp->busyUntil;
+    s->reportTime = s->printAgainTime = 0;
+    vp->busyUntil += vp->faults.coverOpenTime; // Stopped until it closes
+    s->clearTime = vp->busyUntil;
+    vp->coverReport = true;
+  }
+}
+
+// Whether the printer is still booting at time at
+static bool stillBooting(struct virtualPrinter *vp, unsigned long at) {
+  if (vp->booting && (KP347_TIME_DIFF(at, vp->bootDone) >= 0))
+    vp->booting = false;
+  return vp->booting;
+}
+
+static void hashByte(struct virtualPrinter *vp, uint8_t b) {
+  vp->stats.pageHash = (vp->stats.pageHash ^ b) * 16777619UL;
+}
+
+// Renders one dot row leaving the printer, NULL for a blank one
+static void emitRow(struct virtualPrinter *vp, const uint8_t *row) {
+  struct virtualStats *s = &vp->stats;
+  uint8_t i;
+
+  if (s->rowsRendered < vp->pageRows) {
+    uint8_t *to = vp->page + s->rowsRendered * VIRTUAL_ROW_BYTES;
+    if (row)
+      memcpy(to, row, VIRTUAL_ROW_BYTES);
+    else
+      memset(to, 0, VIRTUAL_ROW_BYTES);
+  }
+  for (i = 0; i < VIRTUAL_ROW_BYTES; i++)
+    hashByte(vp, row ? row[i] : 0);
+  s->rowsRendered++;
+}
+
+static void setDot(uint8_t *row, uint16_t x) {
+  if (x < LINE_DOTS)
+    row[x >> 3] |= 0x80 >> (x & 7);
+}
+
+// Dot (x, y) of the made-up w x h glyph picked by seed.  The last column
+// and row stay blank, keeping characters apart.
+static bool glyphDot(uint32_t seed, uint8_t x, uint8_t y, uint8_t w,
+                     uint8_t h) {
+  if ((x >= w - 1) || (y >= h - 1))
+    return false;
+  seed ^= (x * 0x9E3779B1UL) ^ (y * 0x85EBCA77UL);
+  seed ^= seed >> 15;
+  seed *= 0x2C1B3C6DUL;
+  seed ^= seed >> 12;
+  return seed & 0x100;
+}
+
+// Draws character c, w x h dots with the current modes, at the column,
+// standing on the bottom of the line buffer.
+static void glyph(struct virtualPrinter *vp, uint8_t c, uint8_t w, uint8_t h) {
+  uint8_t mode = vp->printMode, cw = (mode & FONT_MASK) ? 9 : 12,
+          ch = (mode & FONT_MASK) ? 17 : 24, under = vp->underline * h / ch,
+          x, y, gx, gy;
+  bool inverse = vp->inverse || (mode & INVERSE_MASK), dot;
+  uint32_t seed = 2166136261UL;
+
+  seed = (seed ^ c) * 16777619UL;
+  seed = (seed ^ (mode & FONT_MASK)) * 16777619UL;
+  if (c >= 0x80)
+    seed = (seed ^ vp->codePage) * 16777619UL;
+  else if (strchr("#$@[\\]^`{|}~", c)) // The ones ESC R changes
+    seed = (seed ^ vp->charset) * 16777619UL;
+
+  for (y = 0; y < h; y++) {
+    gy = y * ch / h;
+    for (x = 0; x < w; x++) {
+      gx = x * cw / w;
+      dot = (c != ' ') &&
+            (glyphDot(seed, gx, gy, cw, ch) ||
+             ((mode & BOLD_MASK) && gx && glyphDot(seed, gx - 1, gy, cw, ch)) ||
+             ((mode & STRIKE_MASK) && (gy == ch / 2)));
+      if (y >= h - under)
+        dot = true;
+      if (inverse)
+        dot = !dot;
+      if (dot)
+        setDot(vp->line[VIRTUAL_LINE_ROWS - h + y], vp->column + x);
+    }
+  }
+}
+
+// Renders the line buffer's rows, justified and turned as the modes say,
+// and empties it.
+static void renderLine(struct virtualPrinter *vp) {
+  uint8_t out[VIRTUAL_ROW_BYTES], r;
+  const uint8_t *from;
+  uint16_t width = (vp->lineWidth > LINE_DOTS) ? LINE_DOTS : vp->lineWidth,
+           shift = 0, x, to;
+  bool turned = vp->upsideDown || (vp->printMode & UPDOWN_MASK);
+
+  if (vp->justify == 1)
+    shift = (LINE_DOTS - width) / 2;
+  else if (vp->justify == 2)
+    shift = LINE_DOTS - width;
+  for (r = 0; r < vp->lineRows; r++) {
+    from = vp->line[turned ? VIRTUAL_LINE_ROWS - 1 - r
+                           : VIRTUAL_LINE_ROWS - vp->lineRows + r];
+    memset(out, 0, sizeof(out));
+    for (x = 0; x < width; x++) {
+      if (from[x >> 3] & (0x80 >> (x & 7))) {
+        to = shift + (turned ? width - 1 - x : x);
+        out[to >> 3] |= 0x80 >> (to & 7);
+      }
+    }
+    emitRow(vp, out);
+  }
+  memset(vp->line[VIRTUAL_LINE_ROWS - vp->lineRows], 0,
+         vp->lineRows * VIRTUAL_ROW_BYTES);
+  vp->lineWidth = 0;
+}
+
+// Prints the line buffer, if anything is in it, and feeds the rest of
+// feedRows counted from the top of the line.
+static void endLine(struct virtualPrinter *vp, unsigned long at,
+                    unsigned long feedRows) {
+  unsigned long rows = vp->lineRows, y;
+
+  renderLine(vp);
+  for (y = rows; y < feedRows; y++)
+    emitRow(vp, NULL);
+  mechanism(vp, at, rows, (feedRows > rows) ? feedRows - rows : 0, 0);
+  vp->lineRows = 0;
+  vp->column = 0;
+}
+
+static void text(struct virtualPrinter *vp, unsigned long at, uint8_t c) {
+  uint8_t w = charWidth(vp), h = charHeight(vp);
+
+  if (c == ASCII_LF) {
+    endLine(vp, at, vp->lineHeight);
+  } else if (c == ASCII_TAB) {
+    vp->column = (vp->column / (4 * w) + 1) * 4 * w;
+  } else if ((c >= ' ') && (c != 0xFF)) { // 0xFF is the wake-up byte
+    if (vp->column + w > LINE_DOTS)
+      endLine(vp, at, vp->lineHeight); // Wrap
+    glyph(vp, c, w, h);
+    vp->column += w;
+    if (vp->lineWidth < vp->column)
+      vp->lineWidth = vp->column;
+    vp->column += vp->charSpacing;
+    if (vp->lineRows < h)
+      vp->lineRows = h;
+  }
+}
+
+// Renders a barcode below the line: bars, then the label's rows, all
+// derived from the barcode's hash.
+static void barcode(struct virtualPrinter *vp) {
+  uint32_t h = vp->barcodeHash;
+  uint16_t y;
+  uint8_t i;
+
+  for (i = 0; i < VIRTUAL_ROW_BYTES; i++) {
+    h = (h ^ i) * 16777619UL;
+    vp->row[i] = h >> 24;
+  }
+  for (y = 0; y < vp->barcodeHeight; y++)
+    emitRow(vp, vp->row);
+  for (y = 0; y < 40; y++)
+    emitRow(vp, vp->barcodeLabel ? vp->row : NULL);
+  memset(vp->row, 0, sizeof(vp->row));
+}
+
+// Renders a data byte of the command in cmd
+static void dataByte(struct virtualPrinter *vp, uint8_t b) {
+  uint8_t *c = vp->cmd, i;
+
+  switch ((c[0] << 8) | c[1]) {
+  case (ASCII_ESC << 8) | '*': { // Columns, top bit first
+    uint8_t tall = (c[2] >= 32) ? 3 : 1,
+            y = VIRTUAL_LINE_ROWS - 8 * tall + vp->dataPos % tall * 8;
+    uint16_t x = vp->column + vp->dataPos / tall;
+    for (i = 0; i < 8; i++) {
+      if (b & (0x80 >> i))
+        setDot(vp->line[y + i], x);
+    }
+    if (vp->lineWidth < x + 1)
+      vp->lineWidth = x + 1;
+    break;
+  }
+  case (ASCII_DC2 << 8) | '*': // Rows of c[3] bytes
+    i = vp->dataPos % c[3];
+    if (i < VIRTUAL_ROW_BYTES)
+      vp->row[i] = b;
+    if (i == c[3] - 1) {
+      emitRow(vp, vp->row);
+      memset(vp->row, 0, sizeof(vp->row));
+    }
+    break;
+  case (ASCII_GS << 8) | 'k':
+    vp->barcodeHash = (vp->barcodeHash ^ b) * 16777619UL;
+    break;
+  }
+  vp->dataPos++;
+}
+
+// Header length of the command starting with cmd[0..1]
+static uint8_t headerLength(struct virtualPrinter *vp) {
+  switch (vp->cmd[0]) {
+  case ASCII_ESC:
+    switch (vp->cmd[1]) {
+    case '@':
+    case '2':
+    case 'D':
+      return 2;
+    case '8':
+      return (firmwareOf(vp) < 264) ? 3 : 4;
+    case '$':
+      return 4;
+    case '7':
+    case '*':
+      return 5;
+    }
+    return 3;
+  case ASCII_GS:
+    return (vp->cmd[1] == 'V') ? 4 : 3;
+  default: // DC2
+    if (vp->cmd[1] == '*')
+      return 4;
+    return (vp->cmd[1] == 'T') ? 2 : 3;
+  }
+}
+
+// Acts on a complete command header, or on the end of its data
+static void command(struct virtualPrinter *vp, unsigned long at, bool data) {
+  uint8_t *c = vp->cmd, n = c[2];
+  uint16_t rows;
+
+  switch ((c[0] << 8) | c[1]) {
+  case (ASCII_ESC << 8) | '@':
+    resetModes(vp);
+    break;
+  case (ASCII_ESC << 8) | 'D':
+    vp->dataToNul = !data; // Tab stops up to a NUL
+    break;
+  case (ASCII_ESC << 8) | 'J':
+    endLine(vp, at, n);
+    break;
+  case (ASCII_ESC << 8) | 'd':
+    endLine(vp, at, (unsigned long)n * vp->lineHeight);
+    break;
+  case (ASCII_ESC << 8) | 'v':
+  case (ASCII_GS << 8) | 'r':
+    if (stillBooting(vp, at))
+      break;
+    queueReply(vp, vp->paperOut ? STATUS_PAPER_OUT : 0, at);
+    vp->stats.replies++;
+    if (vp->paperOut && !vp->stats.reportTime)
+      vp->stats.reportTime = at + vp->faults.statusDelay;
+    if (vp->coverReport) {
+      // First query since the cover opened: if it came while open, it
+      // went unanswered from its arrival (or the opening, if earlier)
+      vp->coverReport = false;
+      if (KP347_TIME_DIFF(vp->arrived, vp->stats.clearTime) >= 0)
+        vp->stats.reportTime = at + vp->faults.statusDelay; // Asked after
+      else if (KP347_TIME_DIFF(vp->arrived, vp->stats.faultTime) > 0)
+        vp->stats.reportTime = vp->arrived;
+      else
+        vp->stats.reportTime = vp->stats.faultTime;
+    }
+    break;
+  case (ASCII_ESC << 8) | '!':
+    vp->printMode = n;
+    break;
+  case (ASCII_ESC << 8) | '2':
+    vp->lineHeight = 30;
+    break;
+  case (ASCII_ESC << 8) | '3':
+    vp->lineHeight = n;
+    break;
+  case (ASCII_ESC << 8) | '$':
+    vp->column = n | (c[3] << 8);
+    break;
+  case (ASCII_ESC << 8) | '-':
+    vp->underline = (n > 2) ? 2 : n;
+    break;
+  case (ASCII_ESC << 8) | 'a':
+    vp->justify = n;
+    break;
+  case (ASCII_ESC << 8) | '{':
+    vp->upsideDown = n & 1;
+    break;
+  case (ASCII_ESC << 8) | ' ':
+    vp->charSpacing = n;
+    break;
+  case (ASCII_ESC << 8) | 'R':
+    vp->charset = n;
+    break;
+  case (ASCII_ESC << 8) | 't':
+    vp->codePage = n;
+    break;
+  case (ASCII_GS << 8) | 'B':
+    vp->inverse = n & 1;
+    break;
+  case (ASCII_GS << 8) | 'H':
+    vp->barcodeLabel = n;
+    break;
+  case (ASCII_GS << 8) | 'w':
+    vp->barcodeWidth = n;
+    break;
+  case (ASCII_ESC << 8) | '*':
+    if (!data) {
+      vp->dataLeft = (unsigned long)(c[3] | (c[4] << 8)) * ((n >= 32) ? 3 : 1);
+    } else {
+      vp->column += c[3] | (c[4] << 8);
+      if (vp->lineRows < ((n >= 32) ? 24 : 8))
+        vp->lineRows = (n >= 32) ? 24 : 8;
+    }
+    break;
+  case (ASCII_GS << 8) | 'V':
+    endLine(vp, at, 0);
+    for (rows = 0; rows < c[3]; rows++)
+      emitRow(vp, NULL);
+    hashByte(vp, c[2]); // Where the cut was, and which kind
+    mechanism(vp, at, 0, c[3], vp->profile->cutTime);
+    vp->stats.cuts++;
+    break;
+  case (ASCII_GS << 8) | 'h':
+    vp->barcodeHeight = n;
+    break;
+  case (ASCII_GS << 8) | 'k':
+    if (!data) {
+      if (n >= 65)
+        vp->lengthNext = true;
+      else
+        vp->dataToNul = true; // Older firmware: up to a NUL
+      // Symbology, bar width, label and position all show on paper
+      vp->barcodeHash = (2166136261UL ^ n) * 16777619UL;
+      vp->barcodeHash = (vp->barcodeHash ^ vp->barcodeWidth) * 16777619UL;
+      vp->barcodeHash = (vp->barcodeHash ^ vp->barcodeLabel) * 16777619UL;
+      vp->barcodeHash = (vp->barcodeHash ^ vp->justify) * 16777619UL;
+    } else {
+      endLine(vp, at, 0);
+      barcode(vp);
+      mechanism(vp, at, vp->barcodeHeight + 40, 0, 0);
+    }
+    break;
+  case (ASCII_GS << 8) | 'I':
+    if ((n == 65) && !stillBooting(vp, at)) {
+      uint16_t fw = firmwareOf(vp);
+      queueReply(vp, '_', at);
+      queueReply(vp, '0' + fw / 100, at);
+      queueReply(vp, '.', at);
+      queueReply(vp, '0' + fw / 10 % 10, at);
+      queueReply(vp, '0' + fw % 10, at);
+      queueReply(vp, 0, at);
+    }
+    break;
+  case (ASCII_DC2 << 8) | '*':
+    if (!data)
+      vp->dataLeft = (unsigned long)n * c[3];
+    else
+      mechanism(vp, at, n, 0, 0);
+    break;
+  case (ASCII_DC2 << 8) | 'T':
+    endLine(vp, at, 0);
+    memset(vp->row, 0x55, sizeof(vp->row)); // Stands in for the test page
+    for (rows = 0; rows < 1200; rows++)
+      emitRow(vp, vp->row);
+    memset(vp->row, 0, sizeof(vp->row));
+    mechanism(vp, at, 1200, 0, 0); // Test page, roughly
+    break;
+  }
+}
+
+// Takes one byte from the input buffer at time at
+static void consume(struct virtualPrinter *vp, unsigned long at, uint8_t b) {
+  if (vp->lengthNext) { // GS k m n: n bytes of data follow
+    vp->lengthNext = false;
+    vp->dataLeft = b;
+    if (!b)
+      command(vp, at, true);
+  } else if (vp->dataLeft) {
+    dataByte(vp, b);
+    if (!--vp->dataLeft)
+      command(vp, at, true);
+  } else if (vp->dataToNul) {
+    if (!b) {
+      vp->dataToNul = false;
+      command(vp, at, true);
+    } else {
+      dataByte(vp, b);
+    }
+  } else if (vp->cmdLen) {
+    vp->cmd[vp->cmdLen++] = b;
+    if (vp->cmdLen == 2)
+      vp->cmdNeed = headerLength(vp);
+    if (vp->cmdLen == vp->cmdNeed) {
+      vp->cmdLen = 0;
+      vp->dataPos = 0;
+      command(vp, at, false);
+    }
+  } else if ((b == ASCII_ESC) || (b == ASCII_GS) || (b == ASCII_DC2)) {
+    vp->cmd[0] = b;
+    vp->cmdLen = 1;
+    vp->cmdNeed = 2;
+  } else {
+    text(vp, at, b);
+  }
+}
+
+// Works through the input buffer up to time t
+static void run(struct virtualPrinter *vp, unsigned long t) {
+  unsigned long at;
+
+  while (vp->count) {
+    at = vp->arrival[vp->head];
+    if (KP347_TIME_DIFF(vp->busyUntil, at) > 0)
+      at = vp->busyUntil;
+    if (vp->reloadAt && (KP347_TIME_DIFF(at, vp->reloadAt) >= 0))
+      reload(vp, vp->reloadAt);
+    if (KP347_TIME_DIFF(at, t) > 0)
+      break;
+    vp->arrived = vp->arrival[vp->head];
+    consume(vp, at, vp->in[vp->head]);
+    vp->head = (vp->head + 1) % VIRTUAL_BUFFER;
+    vp->count--;
+  }
+  if (vp->reloadAt && (KP347_TIME_DIFF(t, vp->reloadAt) >= 0))
+    reload(vp, vp->reloadAt);
+}
+
+int virtualSend(void *context, const uint8_t *data, uint16_t len) {
+  struct virtualPrinter *vp = (struct virtualPrinter *)context;
+  unsigned long now = micros();
+  uint16_t i;
+  uint8_t b;
+
+  for (i = 0; i < len; i++) {
+    if (KP347_TIME_DIFF(vp->linkFree, now) < 0)
+      vp->linkFree = now;
+    vp->linkFree += vp->byteTime;
+    run(vp, vp->linkFree); // The printer keeps working while bytes arrive
+    b = data[i];
+    if (vp->faults.dropRate && (nextRandom(vp) < vp->faults.dropRate)) {
+      vp->stats.bytesDropped++;
+      continue;
+    }
+    if (vp->faults.corruptRate && (nextRandom(vp) < vp->faults.corruptRate)) {
+      b ^= 1 << (nextRandom(vp) & 7);
+      vp->stats.bytesCorrupted++;
+    }
+    if (vp->count == VIRTUAL_BUFFER) {
+      vp->stats.bytesOverflowed++;
+      continue;
+    }
+    vp->in[(vp->head + vp->count) % VIRTUAL_BUFFER] = b;
+    vp->arrival[(vp->head + vp->count) % VIRTUAL_BUFFER] = vp->linkFree;
+    vp->count++;
+    vp->stats.bytesIn++;
+  }
+  return len;
+}
+
+int virtualRead(struct virtualPrinter *vp) {
+  unsigned long now = micros();
+  uint8_t c;
+
+  run(vp, now);
+  if (!vp->replyCount ||
+      (KP347_TIME_DIFF(now, vp->replyDue[vp->replyHead]) < 0))
+    return -1;
+  c = vp->reply[vp->replyHead];
+  vp->replyHead = (vp->replyHead + 1) % VIRTUAL_REPLIES;
+  vp->replyCount--;
+  return c;
+}
+
+bool virtualBusy(struct virtualPrinter *vp) {
+  unsigned long now = micros();
+
+  run(vp, now);
+  return vp->count || (KP347_TIME_DIFF(vp->busyUntil, now) > 0);
+}
+
+void virtualLoadPaper(struct virtualPrinter *vp) {
+  if (vp->paperOut)
+    reload(vp, micros());
+}
+
+long virtualCompare(const struct virtualPrinter *a,
+                    const struct virtualPrinter *b) {
+  unsigned long rows = a->stats.rowsRendered, kept = 0, y;
+
+  if (rows > b->stats.rowsRendered)
+    rows = b->stats.rowsRendered;
+  if (a->page && b->page) {
+    kept = (a->pageRows < b->pageRows) ? a->pageRows : b->pageRows;
+    if (kept > rows)
+      kept = rows;
+  }
+  for (y = 0; y < kept; y++) {
+    if (memcmp(a->page + y * VIRTUAL_ROW_BYTES, b->page + y * VIRTUAL_ROW_BYTES,
+               VIRTUAL_ROW_BYTES))
+      return y;
+  }
+  if ((a->stats.rowsRendered == b->stats.rowsRendered) &&
+      (a->stats.pageHash == b->stats.pageHash))
+    return -1;
+  return kept; // The difference lies past what the pages hold
+}
+
+#endif // KP347_VIRTUAL
@@ -0,0 +1,185 @@
+/*!
+ * @file kp347-virtual.h
+ *
+ * Virtual printer: a stand-in that takes the library's byte stream the
+ * way the real one does, for benchmarks that shouldn't use paper.  It has
+ * an input buffer that overflows, a mechanism timed from a printerProfile,
+ * and answers status and firmware queries.  Faults can be scripted
+ * (struct virtualFaults) to measure how long the library takes to notice
+ * and get over them, and how much paper they cost (struct virtualStats).
+ *
+ * Time comes from micros().  The printer catches up whenever it is sent
+ * bytes or asked for a reply, so it needs no thread of its own.
+ * virtualSend() has the signature of struct fanoutPrinter's send, so a
+ * fan-out can drive several; the Linux port opens one for the path
+ * "virtual" (see kp347LinuxVirtual()).
+ *
+ * Paper out: the printer goes on working through its input, answering
+ * status queries with STATUS_PAPER_OUT, but prints nothing.  Cover open:
+ * the printer stops altogether, status queries included, until it is
+ * closed again.
+ *
+ * The printer also renders what it is sent, one 384-dot row at a time,
+ * into a page hash and, if given one, a page buffer.  Two encodings of
+ * the same output (say with and without an optimization) render the same
+ * rows; virtualCompare() finds the first row where they don't.  Text
+ * comes out in a made-up font, each character a fixed dot pattern for
+ * its code, font and style, and a barcode as rows derived from its data.
+ * That is enough to tell encodings apart, though not to read the page.
+ * Paper and cover faults don't change what is rendered.
+ */
+
+#ifndef KP347_VIRTUAL_H
+#define KP347_VIRTUAL_H
+
+#include "kp347-printer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VIRTUAL_BUFFER 4096 //!< Input buffer of the virtual printer, in bytes
+#define VIRTUAL_REPLIES 16  //!< Reply bytes it holds until they are read
+#define VIRTUAL_BOOT_TIME 500000UL //!< A bootTime like a real printer's, in us
+#define VIRTUAL_ROW_BYTES 48 //!< Bytes per rendered dot row (384 dots)
+#define VIRTUAL_LINE_ROWS 48 //!< Tallest text line it renders, in dot rows
+
+/*!
+ * Scripted faults.  Dot rows count printed and fed rows alike, from
+ * virtualBegin().
+ */
+struct virtualFaults {
+  unsigned long paperOutRow;   /**< Paper runs out at this dot row, 0 = never */
+  unsigned long reloadTime;    /**< Paper reloaded this long after running out,
+                                    in us, 0 = only by virtualLoadPaper() */
+  unsigned long coverOpenRow;  /**< Cover opened at this dot row, 0 = never */
+  unsigned long coverOpenTime; /**< How long it stays open, in us */
+  uint16_t dropRate;           /**< Received bytes lost, per 65536 */
+  uint16_t corruptRate;        /**< Received bytes with one bit flipped, per 65536 */
+  unsigned long statusDelay;   /**< Extra time before each reply, in us */
+  uint8_t slowPercent;         /**< Extra mechanism time (cold head), in percent */
+  uint32_t seed;               /**< Seed for dropRate and corruptRate, 0 = 1 */
+  unsigned long bootTime;      /**< Queries go unanswered this long after
+                                    virtualBegin(), as while booting, in us;
+                                    makes begin() take its cold path */
+};
+
+/*!
+ * What the virtual printer went through.  Times are micros() values; a
+ * fault's time to detect is reportTime - faultTime, its time to recover
+ * printAgainTime - clearTime.  An open cover shows only as a status query
+ * going unanswered, so its reportTime is when the first query came in
+ * while it was open, or else the first reply after it closed.
+ */
+struct virtualStats {
+  unsigned long bytesIn;        /**< Bytes that reached the printer */
+  unsigned long bytesDropped;   /**< Lost on the link (dropRate) */
+  unsigned long bytesCorrupted; /**< Damaged on the link (corruptRate) */
+  unsigned long bytesOverflowed; /**< Lost because the input buffer was full */
+  unsigned long rowsPrinted;    /**< Dot rows printed */
+  unsigned long rowsFed;        /**< Dot rows fed */
+  unsigned long rowsLost;       /**< Rows asked for while out of paper */
+  uint16_t cuts;                /**< Cuts made */
+  uint16_t replies;             /**< Status replies sent */
+  unsigned long faultTime;      /**< Last fault began, 0 if none yet */
+  unsigned long reportTime;     /**< First status reply showing it (or for
+                                     the cover, left unanswered), 0 if none */
+  unsigned long clearTime;      /**< It was cleared, 0 if not yet */
+  unsigned long printAgainTime; /**< First row printed after that, 0 if none */
+  unsigned long rowsRendered;   /**< Dot rows rendered, printed and fed */
+  uint32_t pageHash;            /**< FNV-1a of the rendered rows and cuts */
+};
+
+/*!
+ * One virtual printer.  Set profile, byteTime, faults and the page buffer
+ * through virtualBegin() and directly; the rest is its state.
+ */
+struct virtualPrinter {
+  const struct printerProfile *profile; /**< Timing, firmware, cutter offset */
+  unsigned long byteTime; /**< Link time per byte, in microseconds */
+  struct virtualFaults faults;
+  struct virtualStats stats;
+  uint8_t *page; /**< Rendered rows, VIRTUAL_ROW_BYTES each, or NULL */
+  unsigned long pageRows; /**< Rows page holds; later ones are only hashed */
+
+  uint8_t in[VIRTUAL_BUFFER];
+  unsigned long arrival[VIRTUAL_BUFFER]; // When each byte was received
+  uint16_t head, count;
+  unsigned long arrived;   // When the byte being worked on arrived
+  unsigned long linkFree;  // Link busy until then
+  unsigned long busyUntil; // Mechanism (or open cover) busy until then
+  unsigned long reloadAt;
+  uint8_t reply[VIRTUAL_REPLIES];
+  unsigned long replyDue[VIRTUAL_REPLIES];
+  uint8_t replyHead, replyCount;
+  uint8_t cmd[5], cmdLen, cmdNeed; // Command header being collected
+  unsigned long dataLeft;          // Data bytes still to come for cmd
+  bool dataToNul;                  // Data runs up to a NUL instead
+  bool lengthNext;                 // Next byte is the data length
+  uint8_t printMode, lineHeight, barcodeHeight, lineRows;
+  uint16_t column;    // In dots
+  uint16_t lineWidth; // Right edge of what the line holds, in dots
+  uint8_t inverse, upsideDown, underline, justify, charSpacing, charset,
+      codePage, barcodeWidth, barcodeLabel;
+  uint8_t line[VIRTUAL_LINE_ROWS][VIRTUAL_ROW_BYTES]; // Bottom-aligned
+  uint8_t row[VIRTUAL_ROW_BYTES]; // Raster row being received
+  uint16_t dataPos;               // Data bytes of cmd received so far
+  uint32_t barcodeHash;
+  unsigned long bootDone;
+  uint32_t random;
+  bool booting, paperOut, coverDone;
+  bool coverReport; // Cover was open; next status query reports it
+};
+
+/*!
+  * @brief Starts a virtual printer: empty buffer, paper loaded, stats
+  * cleared.  The faults are left as they are.
+  * @param vp Printer
+  * @param profile Timing profile, or NULL for the library's built-in one;
+  * must stay valid.  Its firmware is the version the printer runs, 268 if
+  * 0 (a profile for any version)
+  * @param byteTime Link time per byte, in microseconds
+  */
+void virtualBegin(struct virtualPrinter *vp,
+                  const struct printerProfile *profile,
+                  unsigned long byteTime);
+/*!
+  * @brief Sends bytes to the printer over its link
+  * @param context The struct virtualPrinter
+  * @param data Bytes to send
+  * @param len Number of bytes
+  * @return Returns len; bytes the printer has no room for are lost
+  */
+int virtualSend(void *context, const uint8_t *data, uint16_t len);
+/*!
+  * @brief Reads a reply byte
+  * @param vp Printer
+  * @return Returns the byte, or -1 if none is due yet
+  */
+int virtualRead(struct virtualPrinter *vp);
+/*!
+  * @brief Whether the printer still has input or mechanism work left
+  * @param vp Printer
+  * @return Returns true until everything sent so far is done
+  */
+bool virtualBusy(struct virtualPrinter *vp);
+/*!
+  * @brief Loads paper after a paper-out
+  * @param vp Printer
+  */
+void virtualLoadPaper(struct virtualPrinter *vp);
+/*!
+  * @brief Compares what two printers rendered
+  * @param a One printer
+  * @param b The other
+  * @return Returns -1 if they rendered the same rows and cuts, else the
+  * first row that differs, or that their page buffers can't show to match
+  */
+long virtualCompare(const struct virtualPrinter *a,
+                    const struct virtualPrinter *b);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // KP347_VIRTUAL_H
@@ -0,0 +1,643 @@
+/*!
+ * @file port-linux.c
+ *
+ * Host backends for usblp, USB-serial adapters, the virtual printer and
+ * file stand-ins, and the metrics server; see port-linux.h.
+ */
+
+#ifdef KP347_PORT_LINUX
+
+#include "kp347-virtual.h" // Also brings in port-linux.h
+#undef write // The C library's write() and sleep() from here on
+#undef sleep
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define TX_BUFFER 4096 //!< Bytes collected before a write is forced
+#define NULL_LINK_SKIP 10000000UL //!< Clock jump per wait on the null link, in us
+#define COMPARE_ROWS 16384 //!< Dot rows kp347LinuxCompare() keeps (2 m of paper)
+#define METRICS_TEXT 4096    //!< Room for one scrape's response
+#define METRICS_REQUEST 1024 //!< Request bytes read before answering
+#define METRICS_TIMEOUT 1000 //!< Time a client gets to send its request, in ms
+
+static int fd = -1, linkType = KP347_LINK_NONE, lastError;
+static unsigned long baud = 19200;
+static uint8_t txBuf[TX_BUFFER];
+static size_t txLen;
+static int rxByte = -1; // One byte of read-ahead for kp347LinuxAvailable()
+static int streamIn = STDIN_FILENO, streamOut = STDOUT_FILENO;
+static unsigned long clockOffset; // Added to CLOCK_MONOTONIC by micros()
+static bool simulatedClock; // clockOffset is the whole clock
+static bool clock32;        // micros() wraps at 32 bits, as on the MCU
+static unsigned long bytesSent;
+#if KP347_VIRTUAL
+static struct virtualPrinter virt;
+#endif
+
+// Writes all of buf, waiting for the descriptor if it is non-blocking.
+static void writeAll(int to, const uint8_t *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(to, buf, len);
+    if (n > 0) {
+      buf += n;
+      len -= n;
+    } else if ((n < 0) && (errno == EAGAIN)) {
+      struct pollfd p = {to, POLLOUT, 0};
+      poll(&p, 1, -1);
+    } else if ((n < 0) && (errno != EINTR)) {
+      lastError = errno; // Rest is dropped; the library can't take an error
+      return;
+    }
+  }
+}
+
+static speed_t speedOf(long bps) {
+  switch (bps) {
+  case 9600:
+    return B9600;
+  case 19200:
+    return B19200;
+  case 38400:
+    return B38400;
+  case 57600:
+    return B57600;
+  case 115200:
+    return B115200;
+  case 230400:
+    return B230400;
+  case 460800:
+    return B460800;
+  case 921600:
+    return B921600;
+  case 1000000:
+    return B1000000;
+  case 1500000:
+    return B1500000;
+  case 2000000:
+    return B2000000;
+  case 3000000:
+    return B3000000;
+  default:
+    return B0;
+  }
+}
+
+static bool setSerial(long bps) {
+  struct termios tio;
+  speed_t speed = speedOf(bps);
+
+  if (speed == B0) {
+    errno = EINVAL;
+    return false;
+  }
+  if (tcgetattr(fd, &tio) < 0)
+    return false;
+  cfmakeraw(&tio);
+  tio.c_cflag |= CLOCAL | CREAD;
+  tio.c_cflag &= ~(CRTSCTS | CSTOPB); // 8N1, no flow control
+  tio.c_cc[VMIN] = 0;
+  tio.c_cc[VTIME] = 0;
+  cfsetispeed(&tio, speed);
+  cfsetospeed(&tio, speed);
+  return tcsetattr(fd, TCSANOW, &tio) == 0;
+}
+
+int kp347LinuxOpen(const char *path, long bps) {
+  struct stat st;
+
+  kp347LinuxClose();
+  bytesSent = 0;
+  if (!strcmp(path, "null")) {
+    baud = bps ? bps : 19200;
+    linkType = KP347_LINK_NULL;
+    lastError = 0;
+    return linkType;
+  }
+#if KP347_VIRTUAL
+  if (!strcmp(path, "virtual")) {
+    baud = bps ? bps : 19200;
+    virtualBegin(&virt, virt.profile, (11000000UL + baud / 2) / baud);
+    linkType = KP347_LINK_VIRTUAL;
+    lastError = 0;
+    return linkType;
+  }
+#endif
+  if (!strncmp(path, "/dev/usb/lp", 11)) {
+    fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    linkType = KP347_LINK_USBLP;
+    baud = bps ? bps : KP347_USB_BAUD;
+  } else if (!stat(path, &st) && S_ISCHR(st.st_mode)) {
+    fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    linkType = KP347_LINK_SERIAL;
+    baud = bps ? bps : 19200;
+    if ((fd >= 0) && isatty(fd) && !setSerial(baud)) {
+      int e = errno;
+      close(fd);
+      fd = -1;
+      errno = e;
+    }
+  } else {
+    int flags = O_WRONLY | O_TRUNC | O_CLOEXEC;
+
+    // Only an explicit file: link may create a file, and never under /dev,
+    // so a misspelled device name fails instead of filling a file
+    if (!strncmp(path, "file:", 5)) {
+      path += 5;
+      if (strncmp(path, "/dev/", 5))
+        flags |= O_CREAT;
+    }
+    // Blocks until a FIFO has a reader, like a printer being switched on
+    fd = open(path, flags, 0644);
+    linkType = KP347_LINK_FILE;
+    baud = bps ? bps : 19200;
+  }
+  if (fd < 0) {
+    linkType = KP347_LINK_NONE;
+    return KP347_LINK_NONE;
+  }
+  lastError = 0;
+  return linkType;
+}
+
+void kp347LinuxClose() {
+  kp347LinuxFlush();
+  if (fd >= 0)
+    close(fd);
+  fd = -1;
+  linkType = KP347_LINK_NONE;
+  rxByte = -1;
+}
+
+void kp347LinuxSetStream(int in, int out) {
+  streamIn = in;
+  streamOut = out;
+}
+
+int kp347LinuxError() { return lastError; }
+
+unsigned long kp347LinuxBytesSent() { return bytesSent; }
+
+struct virtualPrinter *kp347LinuxVirtual() {
+#if KP347_VIRTUAL
+  return &virt;
+#else
+  return NULL;
+#endif
+}
+
+bool kp347LinuxCompare(void (*reference)(void), void (*optimized)(void),
+                       long bps, struct kp347Comparison *result) {
+#if KP347_VIRTUAL
+  void (*runs[2])(void) = {reference, optimized};
+  struct virtualPrinter *ref = malloc(sizeof(*ref));
+  uint8_t *pages = malloc(2UL * COMPARE_ROWS * VIRTUAL_ROW_BYTES);
+  unsigned long bootTime = virt.faults.bootTime, start;
+  int i;
+
+  if (!ref || !pages) {
+    free(ref);
+    free(pages);
+    errno = ENOMEM;
+    return false;
+  }
+  // A dry run first, so both runs find the same retained configuration
+  // (KP347_WARM_START) and send the same begin() sequence
+  kp347LinuxOpen("null", bps);
+  reference();
+  timeoutWait();
+  // Switched on for each run, so neither begin() finds the other's state
+  virt.faults.bootTime = VIRTUAL_BOOT_TIME;
+  virt.pageRows = COMPARE_ROWS;
+  for (i = 0; i < 2; i++) {
+    virt.page = pages + i * COMPARE_ROWS * VIRTUAL_ROW_BYTES;
+    kp347LinuxOpen("virtual", bps);
+    start = kp347LinuxMicros();
+    runs[i]();
+    timeoutWait(); // Done as far as the library can tell...
+    kp347LinuxFlush();
+    while (virtualBusy(&virt)) // ...and in fact
+      kp347LinuxYield();
+    result->time[i] = KP347_TIME_DIFF(kp347LinuxMicros(), start);
+    result->bytes[i] = bytesSent;
+    result->rows[i] = virt.stats.rowsRendered;
+    if (!i)
+      *ref = virt;
+  }
+  result->firstDiff = virtualCompare(ref, &virt);
+  kp347LinuxClose();
+  virt.faults.bootTime = bootTime;
+  virt.page = NULL;
+  virt.pageRows = 0;
+  free(ref);
+  free(pages);
+  return result->firstDiff < 0;
+#else
+  (void)reference;
+  (void)optimized;
+  (void)bps;
+  (void)result;
+  errno = ENOSYS;
+  return false;
+#endif
+}
+
+void kp347LinuxSendByte(uint8_t data) {
+  bytesSent++;
+  if (linkType == KP347_LINK_NULL)
+    return;
+  if (txLen == TX_BUFFER)
+    kp347LinuxFlush();
+  txBuf[txLen++] = data;
+}
+
+void kp347LinuxFlush() {
+#if KP347_VIRTUAL
+  if (txLen && (linkType == KP347_LINK_VIRTUAL))
+    virtualSend(&virt, txBuf, txLen);
+#endif
+  if (txLen && (fd >= 0))
+    writeAll(fd, txBuf, txLen);
+  txLen = 0;
+}
+
+int kp347LinuxAvailable() {
+  uint8_t c;
+
+  kp347LinuxFlush(); // A reply can't come before the query has gone out
+#if KP347_VIRTUAL
+  if ((rxByte < 0) && (linkType == KP347_LINK_VIRTUAL))
+    rxByte = virtualRead(&virt);
+#endif
+  if ((rxByte < 0) && (fd >= 0) && (linkType != KP347_LINK_FILE) &&
+      (read(fd, &c, 1) == 1))
+    rxByte = c;
+  return rxByte >= 0;
+}
+
+uint8_t kp347LinuxReceive() {
+  uint8_t c;
+
+  if (!kp347LinuxAvailable())
+    return 0;
+  c = rxByte;
+  rxByte = -1;
+  return c;
+}
+
+int kp347LinuxStreamRead() {
+  struct pollfd p = {streamIn, POLLIN, 0};
+  uint8_t c;
+
+  if ((streamIn < 0) || (poll(&p, 1, 0) != 1) || (read(streamIn, &c, 1) != 1))
+    return -1;
+  return c;
+}
+
+void kp347LinuxStreamWrite(uint8_t data) {
+  if (streamOut >= 0)
+    writeAll(streamOut, &data, 1);
+}
+
+unsigned long kp347LinuxBaud() { return baud; }
+
+static unsigned long systemMicros() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long)ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+unsigned long kp347LinuxMicros() {
+  unsigned long now;
+
+  if (simulatedClock)
+    now = clockOffset++; // A microsecond per reading
+  else
+    now = systemMicros() + clockOffset;
+  return clock32 ? (uint32_t)now : now;
+}
+
+// Time stamp counter where there is one, else nanoseconds
+unsigned long kp347LinuxCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+#endif
+}
+
+#if KP347_STATS
+static int metricsFd = -1;
+static pthread_t metricsThread;
+static const char *metricsPrinter;
+static struct sockaddr_un metricsPath; // Unlinked on stop, if a Unix socket
+
+// The uint32_t counters of struct printerStats, by metric name
+static const struct metricCounter {
+  const char *name, *help;
+  size_t offset;
+} metricCounters[] = {
+    {"kp347_status_queries", "Status queries sent",
+     offsetof(struct printerStats, statusQueries)},
+    {"kp347_status_lost", "Status queries never answered",
+     offsetof(struct printerStats, statusLost)},
+    {"kp347_overruns", "Status queries lost while the printer was on",
+     offsetof(struct printerStats, overruns)},
+    {"kp347_paper_outs", "Times the paper ran out",
+     offsetof(struct printerStats, paperOuts)},
+    {"kp347_recoveries", "Times paper was back after running out",
+     offsetof(struct printerStats, recoveries)},
+    {"kp347_sleeps", "Auto-sleep commands sent",
+     offsetof(struct printerStats, sleeps)},
+    {"kp347_wakes", "Wake-ups sent", offsetof(struct printerStats, wakes)},
+};
+
+// Appends to buf; once something didn't fit, *len stays at METRICS_TEXT
+static void appendf(char *buf, size_t *len, const char *format, ...) {
+  va_list args;
+  int n;
+
+  if (*len >= METRICS_TEXT)
+    return;
+  va_start(args, format);
+  n = vsnprintf(buf + *len, METRICS_TEXT - *len, format, args);
+  va_end(args);
+  if (n >= 0)
+    *len = (*len + n < METRICS_TEXT) ? *len + n : METRICS_TEXT;
+}
+
+// One scrape, in the OpenMetrics text format; returns 0 if it didn't fit,
+// rather than a cut-off text without its # EOF
+static size_t metricsText(char *buf) {
+  const char *p = metricsPrinter;
+  struct printerStats s;
+  unsigned long limit = 1000;
+  uint32_t waits = 0;
+  size_t len = 0, i;
+
+  statsRead(&s);
+  appendf(buf, &len,
+          "# TYPE kp347_sent_bytes counter\n"
+          "# UNIT kp347_sent_bytes bytes\n"
+          "# HELP kp347_sent_bytes Bytes sent to the printer\n"
+          "kp347_sent_bytes_total{printer=\"%s\"} %lu\n"
+          "# TYPE kp347_queue_bytes gauge\n"
+          "# UNIT kp347_queue_bytes bytes\n"
+          "# HELP kp347_queue_bytes Bytes sent ahead, not yet printed\n"
+          "kp347_queue_bytes{printer=\"%s\"} %u\n"
+          "# TYPE kp347_wait_seconds histogram\n"
+          "# UNIT kp347_wait_seconds seconds\n"
+          "# HELP kp347_wait_seconds Waits for the printer\n",
+          p, (unsigned long)s.bytesSent, p, s.aheadBytes);
+  for (i = 0; i < STATS_WAIT_BUCKETS - 1; i++, limit *= 4) {
+    waits += s.waitBuckets[i];
+    appendf(buf, &len,
+            "kp347_wait_seconds_bucket{printer=\"%s\",le=\"%g\"} %lu\n", p,
+            limit / 1e6, (unsigned long)waits);
+  }
+  // The total, not s.waits: +Inf must match the buckets even if they wrap
+  waits += s.waitBuckets[i];
+  appendf(buf, &len,
+          "kp347_wait_seconds_bucket{printer=\"%s\",le=\"+Inf\"} %lu\n"
+          "kp347_wait_seconds_count{printer=\"%s\"} %lu\n"
+          "kp347_wait_seconds_sum{printer=\"%s\"} %.6f\n",
+          p, (unsigned long)waits, p, (unsigned long)waits, p,
+          s.waitMicros / 1e6);
+  for (i = 0; i < sizeof(metricCounters) / sizeof(metricCounters[0]); i++) {
+    const struct metricCounter *c = &metricCounters[i];
+    appendf(buf, &len,
+            "# TYPE %s counter\n# HELP %s %s\n%s_total{printer=\"%s\"} %lu\n",
+            c->name, c->name, c->help, c->name, p,
+            (unsigned long)*(const uint32_t *)((const uint8_t *)&s +
+                                                c->offset));
+  }
+  appendf(buf, &len,
+          "# TYPE kp347_paper_out gauge\n"
+          "# HELP kp347_paper_out Last status reply said the paper is out\n"
+          "kp347_paper_out{printer=\"%s\"} %d\n"
+          "# EOF\n",
+          p, s.paperOut ? 1 : 0);
+  return (len < METRICS_TEXT) ? len : 0;
+}
+
+static void sendAll(int to, const char *buf, size_t len) {
+  ssize_t n;
+
+  while (len > 0) {
+    n = send(to, buf, len, MSG_NOSIGNAL);
+    if ((n < 0) && (errno == EINTR))
+      continue;
+    if (n <= 0)
+      return; // Client gone
+    buf += n;
+    len -= n;
+  }
+}
+
+// Reads the request up to its blank line and answers it
+static void metricsAnswer(int c) {
+  static char request[METRICS_REQUEST + 1], text[METRICS_TEXT];
+  char header[160];
+  struct pollfd p = {c, POLLIN, 0};
+  size_t got = 0, len;
+  ssize_t n;
+
+  while ((got < METRICS_REQUEST) && (poll(&p, 1, METRICS_TIMEOUT) == 1)) {
+    n = recv(c, request + got, METRICS_REQUEST - got, 0);
+    if (n <= 0)
+      return;
+    got += n;
+    request[got] = 0;
+    if (strstr(request, "\r\n\r\n"))
+      break;
+  }
+  request[got] = 0;
+  if (strncmp(request, "GET /metrics", 12) ||
+      ((request[12] != ' ') && (request[12] != '?'))) {
+    len = snprintf(header, sizeof(header),
+                   "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n"
+                   "Connection: close\r\n\r\n");
+    sendAll(c, header, len);
+    return;
+  }
+  len = metricsText(text);
+  if (!len) {
+    len = snprintf(header, sizeof(header),
+                   "HTTP/1.1 500 Internal Server Error\r\n"
+                   "Content-Length: 0\r\nConnection: close\r\n\r\n");
+    sendAll(c, header, len);
+    return;
+  }
+  n = snprintf(header, sizeof(header),
+               "HTTP/1.1 200 OK\r\n"
+               "Content-Type: application/openmetrics-text; version=1.0.0; "
+               "charset=utf-8\r\nContent-Length: %zu\r\n"
+               "Connection: close\r\n\r\n",
+               len);
+  sendAll(c, header, n);
+  sendAll(c, text, len);
+}
+
+static void *metricsServe(void *arg) {
+  int c;
+
+  (void)arg;
+  // Below the printing thread, so a scrape never holds up a deadline
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+  for (;;) {
+    c = accept(metricsFd, NULL, NULL);
+    if (c >= 0) {
+      metricsAnswer(c);
+      close(c);
+    } else if ((errno != EINTR) && (errno != ECONNABORTED)) {
+      return NULL; // Shut down by kp347LinuxMetricsStop()
+    }
+  }
+}
+#endif
+
+bool kp347LinuxMetricsStart(const char *address, const char *printer) {
+#if KP347_STATS
+  struct sockaddr_in in = {0};
+  int e;
+
+  kp347LinuxMetricsStop();
+  // The label is in every sample, so its length bounds the scrape's
+  if ((strlen(printer) > KP347_METRICS_LABEL) ||
+      strpbrk(printer, "\"\\\n")) {
+    errno = EINVAL;
+    return false;
+  }
+  memset(&metricsPath, 0, sizeof(metricsPath));
+  if (!strncmp(address, "unix:", 5)) {
+    if (strlen(address + 5) >= sizeof(metricsPath.sun_path)) {
+      errno = ENAMETOOLONG;
+      return false;
+    }
+    metricsPath.sun_family = AF_UNIX;
+    strcpy(metricsPath.sun_path, address + 5);
+    unlink(metricsPath.sun_path); // Left over from an earlier run
+    metricsFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ((metricsFd >= 0) && bind(metricsFd, (struct sockaddr *)&metricsPath,
+                                 sizeof(metricsPath)))
+      goto fail;
+  } else {
+    in.sin_family = AF_INET;
+    in.sin_port = htons(atoi(address));
+    in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    metricsFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    e = 1;
+    if ((metricsFd >= 0) &&
+        (setsockopt(metricsFd, SOL_SOCKET, SO_REUSEADDR, &e, sizeof(e)) ||
+         bind(metricsFd, (struct sockaddr *)&in, sizeof(in))))
+      goto fail;
+  }
+  if (metricsFd < 0)
+    return false;
+  metricsPrinter = printer;
+  if (listen(metricsFd, 8))
+    goto fail;
+  e = pthread_create(&metricsThread, NULL, metricsServe, NULL);
+  if (e) {
+    errno = e;
+    goto fail;
+  }
+  return true;
+
+fail:
+  e = errno;
+  close(metricsFd);
+  metricsFd = -1;
+  errno = e;
+  return false;
+#else
+  (void)address;
+  (void)printer;
+  errno = ENOSYS;
+  return false;
+#endif
+}
+
+void kp347LinuxMetricsStop() {
+#if KP347_STATS
+  if (metricsFd < 0)
+    return;
+  shutdown(metricsFd, SHUT_RDWR); // Ends the accept() the thread waits in
+  pthread_join(metricsThread, NULL);
+  close(metricsFd);
+  metricsFd = -1;
+  if (metricsPath.sun_family == AF_UNIX)
+    unlink(metricsPath.sun_path);
+#endif
+}
+
+void kp347LinuxSetMicros(unsigned long now) {
+  clockOffset = simulatedClock ? now : now - systemMicros();
+}
+
+void kp347LinuxWrapClock(bool wrap) { clock32 = wrap; }
+
+void kp347LinuxSimulateClock(bool simulated) {
+  unsigned long now = kp347LinuxMicros();
+
+  simulatedClock = simulated;
+  kp347LinuxSetMicros(now);
+}
+
+// Called while the library waits for the printer: make sure it has
+// everything sent so far, then give the CPU away briefly.
+void kp347LinuxYield() {
+  struct timespec ts = {0, 100000L};
+
+  if (linkType == KP347_LINK_NULL) {
+    clockOffset += NULL_LINK_SKIP; // Any deadline is over at once
+    return;
+  }
+  kp347LinuxFlush();
+  if (simulatedClock)
+    clockOffset += KP347_SIMULATED_STEP;
+  else
+    nanosleep(&ts, NULL);
+}
+
+void delay(unsigned long ms) {
+  struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+
+  if ((linkType == KP347_LINK_NULL) || simulatedClock) {
+    kp347LinuxFlush();
+    clockOffset += ms * 1000;
+    return;
+  }
+  kp347LinuxFlush();
+  while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+    ;
+}
+
+void println(const char *s) {
+  while (*s)
+    kp347Write(*s++);
+  kp347Write('\n');
+}
+
+#endif // KP347_PORT_LINUX
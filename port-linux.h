@@ -0,0 +1,209 @@
+/*!
+ * @file port-linux.h
+ *
+ * Host port, selected by defining KP347_PORT_LINUX.  kp347LinuxOpen()
+ * picks the backend from the path:
+ *
+ *  - /dev/usb/lp*: the USB printer class device (usblp).  Replies such as
+ *    status bytes are read back from the same device.
+ *  - a tty, e.g. /dev/ttyUSB0: a USB-serial adapter, set to raw mode at
+ *    the given baud rate.
+ *  - "virtual": a virtual printer (kp347-virtual.h), with the built-in
+ *    timing and no faults until set up through kp347LinuxVirtual().
+ *  - "null": bytes are counted and dropped, and instead of waiting for
+ *    the printer (or in delay()) the clock jumps ahead, so only the
+ *    library's own CPU time is left to measure.  Nothing answers.
+ *  - anything else, e.g. a plain file or a FIFO: a write-only stand-in
+ *    for tests.  The printer never answers.  The path must exist; with a
+ *    "file:" prefix, e.g. "file:out.bin", a missing file is created
+ *    (never under /dev).
+ *
+ * Bytes are buffered and written in bulk whenever the library starts
+ * timing a task (KP347_FLUSH()), so a raster chunk goes out as a single
+ * write.  BAUDRATE follows the link, so BYTE_TIME shrinks to the USB
+ * transfer time and only the print mechanism limits throughput.
+ *
+ * With KP347_STATS, kp347LinuxMetricsStart() serves the library's
+ * counters to a monitoring system over HTTP, in the OpenMetrics text
+ * format.  It answers from a thread of its own, below the printing
+ * thread's priority, and reads the counters with statsRead(), which
+ * never holds up the printing thread.  Link with -pthread.  They cover
+ * only the library's own printer: printers driven through a fan-out
+ * (kp347-fanout.h) keep no counters and are not exported.
+ *
+ * The library's write() and sleep() would clash with the C library's
+ * functions of the same name, so they are renamed to kp347Write() and
+ * kp347Sleep() here.  Callers still write write(c) and sleep(), but must
+ * include <unistd.h>, if they need it, before kp347-printer.h.
+ */
+
+#ifndef KP347_PRINTER_PORT_LINUX_H
+#define KP347_PRINTER_PORT_LINUX_H
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define KP347_USB_BAUD 12000000L //!< Link speed assumed for usblp (USB full speed)
+#define KP347_SIMULATED_STEP 100 //!< Simulated time per yield(), in us
+#define KP347_METRICS_LABEL 64   //!< Longest printer label for the metrics
+
+/*!
+ * Kind of link opened by kp347LinuxOpen()
+ */
+enum kp347LinuxLinks {
+  KP347_LINK_NONE,   /**< Not open */
+  KP347_LINK_USBLP,  /**< USB printer class device */
+  KP347_LINK_SERIAL, /**< Serial port or USB-serial adapter */
+  KP347_LINK_FILE,   /**< Plain file or FIFO, write-only */
+  KP347_LINK_VIRTUAL, /**< Virtual printer */
+  KP347_LINK_NULL,    /**< Nowhere, without waiting */
+};
+
+struct virtualPrinter;
+
+/*!
+ * Result of kp347LinuxCompare(); index 0 is the reference run
+ */
+struct kp347Comparison {
+  unsigned long bytes[2]; /**< Bytes each run sent */
+  unsigned long time[2];  /**< From the start of each run until the printer
+                               was done, in us */
+  unsigned long rows[2];  /**< Dot rows each run rendered */
+  long firstDiff;         /**< First dot row that differs, -1 if none */
+};
+
+/*!
+  * @brief Opens the printer link
+  * @param path Device, file or FIFO, "file:" and a file to create,
+  * "virtual" or "null"; see the file comment for how each is used
+  * @param baud Link speed in bits per second, or 0 for the default:
+  * 19200 on serial links, files and the virtual printer, KP347_USB_BAUD
+  * on usblp
+  * @return Returns the link type, or KP347_LINK_NONE with errno set
+  */
+int kp347LinuxOpen(const char *path, long baud);
+/*!
+  * @brief Flushes and closes the printer link
+  */
+void kp347LinuxClose();
+/*!
+  * @brief Sets the host stream used by printBitmap() and the RPC server
+  * @param in Descriptor to read from, -1 for none (default: stdin)
+  * @param out Descriptor replies are written to (default: stdout)
+  */
+void kp347LinuxSetStream(int in, int out);
+/*!
+  * @brief Last error seen on the printer link
+  * @return Returns an errno value, 0 if none
+  */
+int kp347LinuxError();
+/*!
+  * @brief Bytes sent since the link was opened
+  * @return Returns the count
+  */
+unsigned long kp347LinuxBytesSent();
+/*!
+  * @brief The virtual printer behind the "virtual" link, for setting up
+  * faults and reading its stats
+  * @return Returns the printer, or NULL if KP347_VIRTUAL is off
+  */
+struct virtualPrinter *kp347LinuxVirtual();
+/*!
+  * @brief Runs two encodings of the same output through the virtual
+  * printer and compares what they print, e.g. a workload with and without
+  * an optimization.  Each run gets a freshly switched-on printer, with
+  * the faults and profile set through kp347LinuxVirtual(), and must call
+  * begin() itself; a run ends once both the library and the printer are
+  * done.  The reference also runs once beforehand on the "null" link, so
+  * both find the same retained configuration.  The link is closed
+  * afterwards.
+  * @param reference Run whose output is taken as right
+  * @param optimized Run to check against it
+  * @param baud Link speed, as for kp347LinuxOpen()
+  * @param result Bytes, times, rows and the first differing row
+  * @return Returns true if both printed the same dots and cuts, false if
+  * not, or if KP347_VIRTUAL is off or memory ran out (errno set)
+  */
+bool kp347LinuxCompare(void (*reference)(void), void (*optimized)(void),
+                       long baud, struct kp347Comparison *result);
+/*!
+  * @brief Starts serving the counters as OpenMetrics at /metrics, for the
+  * library's own printer only (not fan-out targets)
+  * @param address "unix:" and a path for a Unix socket, else a TCP port
+  * on the loopback address, e.g. "9347"
+  * @param printer Value of the printer label, e.g. "kitchen"; at most
+  * KP347_METRICS_LABEL characters, no quotes, backslashes or line breaks,
+  * and must stay valid
+  * @return Returns true if serving, false with errno set (EINVAL for a
+  * bad label, ENOSYS if KP347_STATS is off)
+  */
+bool kp347LinuxMetricsStart(const char *address, const char *printer);
+/*!
+  * @brief Stops serving the counters
+  */
+void kp347LinuxMetricsStop();
+/*!
+  * @brief Makes micros() wrap at 32 bits, as it does on the MCU, instead
+  * of at the host's unsigned long.  With kp347LinuxSetMicros() just short
+  * of 0xFFFFFFFF, a soak run crosses the wrap the MCU sees every 71
+  * minutes.
+  * @param wrap true to keep only the low 32 bits
+  */
+void kp347LinuxWrapClock(bool wrap);
+/*!
+  * @brief Moves the clock micros() reads, e.g. to just short of its wrap
+  * so a soak run crosses it.  Call before begin(), or while nothing is
+  * waiting on a deadline: a jump would look like a long task or none.
+  * @param now Value micros() returns at this moment
+  */
+void kp347LinuxSetMicros(unsigned long now);
+/*!
+  * @brief Switches micros() between the system clock and simulated time.
+  * Simulated time only moves while the library waits: each yield() adds
+  * KP347_SIMULATED_STEP, delay() its full time, and each reading of
+  * micros() one microsecond, so polling loops still end.  Runs against
+  * the virtual printer then take CPU time only and give the same times
+  * on every run.
+  * @param simulated true for simulated time, going on from the current
+  * reading
+  */
+void kp347LinuxSimulateClock(bool simulated);
+
+void kp347LinuxSendByte(uint8_t data);
+void kp347LinuxFlush();
+int kp347LinuxAvailable();
+uint8_t kp347LinuxReceive();
+int kp347LinuxStreamRead();
+void kp347LinuxStreamWrite(uint8_t data);
+unsigned long kp347LinuxBaud();
+unsigned long kp347LinuxMicros();
+unsigned long kp347LinuxCycles();
+void kp347LinuxYield();
+void delay(unsigned long ms);
+void println(const char *s);
+
+#define KP347_SEND_BYTE(data)               kp347LinuxSendByte(data)
+#define KP347_IS_AVAILABLE()                kp347LinuxAvailable()
+#define KP347_RECEIVE()                     kp347LinuxReceive()
+#define KP347_STREAM_READ()                 kp347LinuxStreamRead()
+#define KP347_STREAM_WRITE(data)            kp347LinuxStreamWrite(data)
+#define KP347_FLUSH()                       kp347LinuxFlush()
+#define KP347_CYCLE_COUNTER_INIT()          (void)(NULL)
+#define KP347_CYCLE_COUNTER()               kp347LinuxCycles()
+
+// Plain RAM; a host process has nothing that survives a restart
+#define KP347_RETAINED
+
+#define BAUDRATE                            kp347LinuxBaud()
+#define micros()                            kp347LinuxMicros()
+#define yield()                             kp347LinuxYield()
+#define pgm_read_byte(addr)                 (*(const uint8_t *)(addr))
+#define F(s)                                (s)
+
+#define write(c)                            kp347Write(c)
+#define sleep()                             kp347Sleep()
+
+#endif // KP347_PRINTER_PORT_LINUX_H
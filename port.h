@@ -1,6 +1,11 @@
 #ifndef KP347_PRINTER_PORT_H
 #define KP347_PRINTER_PORT_H
 
+#ifdef KP347_PORT_LINUX
+// Host build: usblp, USB-serial or file backend (see port-linux.h)
+#include "port-linux.h"
+#else
+
 #include "main.h"
 
 #include "Hal/uart.h"
@@ -14,10 +19,30 @@
  * Return -1 if not available
  */
 #define KP347_STREAM_READ()                 UART_stream_read(UART_4)
+// KP347_STREAM_WRITE(data), replies to the host for kp347-rpc.c, is left
+// to the board: it must go out on the host link's UART, not UART_4, or the
+// printer prints the replies.  kp347-rpc.c does not build until it is set.
+
 
+// Storage that survives a watchdog or soft reset (left alone by the startup
+// code), used to remember the printer configuration across MCU restarts.
+// Define as empty to always cold-start the printer in begin().
+#define KP347_RETAINED                      __attribute__((section(".noinit")))
 
 #define micros()             TIMER_get_tick_us()		// Get tick in us
 #define yield()             (void)(NULL)			// Do nothing
+// Bytes go out as they are sent, nothing to flush
+#define KP347_FLUSH()                       (void)(NULL)
+
+// Cycle counter for KP347_CYCLES: the Cortex-M DWT counter
+#define KP347_CYCLE_COUNTER_INIT()                                             \
+  do {                                                                       \
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;                          \
+    DWT->CYCCNT = 0;                                                         \
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;                                     \
+  } while (0)
+#define KP347_CYCLE_COUNTER()               ((unsigned long)DWT->CYCCNT)
 
+#endif // KP347_PORT_LINUX
 
 #endif // KP347_PRINTER_PORT_H
@@ -0,0 +1,214 @@
+/*!
+ * @file kp347-compare.c
+ *
+ * Equivalence harness for encoder optimizations.  Each workload is run
+ * through a reference encoding and an optimized one with
+ * kp347LinuxCompare(); both are rendered by the virtual printer, which
+ * must print the same dots and cuts, and the bytes and time saved are
+ * reported:
+ *
+ *  - blank rows: a bitmap with blank bands, sent row by row through
+ *    printBitmapFromStream() against printBitmapFromBitMap(), whose
+ *    planner feeds the blank runs instead of sending them
+ *  - styles: a receipt setting every style again on each line, as a
+ *    template would, against one setting each only when it changes
+ *  - positioning: table rows padded out with spaces against tableRow(),
+ *    which jumps to each cell with ESC $
+ *
+ * A control pair that differs by one dot must be reported as different,
+ * or the harness itself is broken.  Time is simulated, so the output is
+ * the same on every run.  Exits with 1 if a workload printed differently
+ * or the control went unnoticed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "kp347-virtual.h"
+
+#define BAUD 19200
+#define IMAGE_W 384
+#define IMAGE_H 240
+
+static uint8_t image[IMAGE_H * IMAGE_W / 8];
+static int streamFd = -1;
+
+static const char *const items[][3] = {
+    {"2", "Flat white", "7.00"},  {"1", "Banana bread", "4.50"},
+    {"1", "Orange juice", "5.20"}, {"3", "Croissant", "10.50"},
+    {"1", "Eggs Benedict", "16.00"}, {"2", "Hash brown", "6.00"},
+};
+#define ITEMS (sizeof(items) / sizeof(items[0]))
+
+// Blank rows
+
+static void bitmapStream() {
+  begin(268);
+  lseek(streamFd, 0, SEEK_SET);
+  printBitmapFromStream(IMAGE_W, IMAGE_H);
+  feed(2);
+}
+
+static void bitmapPlanned() {
+  begin(268);
+  printBitmapFromBitMap(IMAGE_W, IMAGE_H, image, false);
+  feed(2);
+}
+
+// Styles
+
+static void stylesEveryLine() {
+  char line[40];
+  unsigned i;
+
+  begin(268);
+  justify('C');
+  doubleHeightOn();
+  boldOn();
+  println("KP347 CAFE");
+  for (i = 0; i < ITEMS; i++) {
+    justify('L');
+    doubleHeightOff();
+    boldOff();
+    underlineOff();
+    snprintf(line, sizeof(line), "%s x %s", items[i][0], items[i][1]);
+    println(line);
+  }
+  justify('L');
+  doubleHeightOff();
+  boldOn();
+  underlineOn(1);
+  println("TOTAL 49.20");
+  boldOff();
+  underlineOff();
+  feed(2);
+}
+
+static void stylesOnChange() {
+  char line[40];
+  unsigned i;
+
+  begin(268);
+  justify('C');
+  doubleHeightOn();
+  boldOn();
+  println("KP347 CAFE");
+  justify('L');
+  doubleHeightOff();
+  boldOff();
+  for (i = 0; i < ITEMS; i++) {
+    snprintf(line, sizeof(line), "%s x %s", items[i][0], items[i][1]);
+    println(line);
+  }
+  boldOn();
+  underlineOn(1);
+  println("TOTAL 49.20");
+  boldOff();
+  underlineOff();
+  feed(2);
+}
+
+// Positioning; 4 + 20 + 8 characters fill the 32-column line
+
+static void tableSpaces() {
+  char line[40];
+  unsigned i;
+
+  begin(268);
+  for (i = 0; i < ITEMS; i++) {
+    snprintf(line, sizeof(line), "%4s%-20s%8s", items[i][0], items[i][1],
+             items[i][2]);
+    println(line);
+  }
+  feed(2);
+}
+
+static void tablePositioned() {
+  static const struct tableColumn columns[3] = {
+      {4, 0, 'R', false}, {20, 0, 'L', false}, {8, 0, 'R', false}};
+  unsigned i;
+
+  begin(268);
+  tableBegin(columns, 3);
+  for (i = 0; i < ITEMS; i++)
+    tableRow(items[i]);
+  feed(2);
+}
+
+// Control: one dot apart
+
+static void bitmapChanged() {
+  image[IMAGE_H / 2 * IMAGE_W / 8 + 5] ^= 0x10;
+  bitmapPlanned();
+  image[IMAGE_H / 2 * IMAGE_W / 8 + 5] ^= 0x10;
+}
+
+static const struct {
+  const char *name;
+  void (*reference)(void);
+  void (*optimized)(void);
+  bool same; // Expected result
+} workloads[] = {
+    {"blank rows", bitmapStream, bitmapPlanned, true},
+    {"styles", stylesEveryLine, stylesOnChange, true},
+    {"positioning", tableSpaces, tablePositioned, true},
+    {"control (one dot)", bitmapPlanned, bitmapChanged, false},
+};
+
+// Saving of b against a, in percent
+static double saving(unsigned long a, unsigned long b) {
+  return a ? 100.0 * ((double)a - b) / a : 0.0;
+}
+
+int main() {
+  struct kp347Comparison r;
+  unsigned i, y;
+  bool same;
+  int failed = 0;
+  FILE *stream;
+
+  // A logo with blank margins and a blank band across the middle
+  for (y = 0; y < IMAGE_H; y++) {
+    if ((y < 40) || ((y >= 110) && (y < 150)) || (y >= 220))
+      continue;
+    for (i = 4; i < IMAGE_W / 8 - 4; i++)
+      image[y * IMAGE_W / 8 + i] = (uint8_t)((y * 5) ^ (i * 29));
+  }
+  stream = tmpfile();
+  if (!stream || (fwrite(image, 1, sizeof(image), stream) != sizeof(image)) ||
+      fflush(stream)) {
+    fprintf(stderr, "kp347-compare: can't write the stream file\n");
+    return 1;
+  }
+  streamFd = fileno(stream);
+  kp347LinuxSetStream(streamFd, -1);
+  kp347LinuxSimulateClock(true);
+  if (!kp347LinuxVirtual()) {
+    fprintf(stderr, "kp347-compare: built without KP347_VIRTUAL\n");
+    return 1;
+  }
+
+  printf("%-18s %-15s %8s %8s %6s %10s %10s %6s\n", "workload", "output",
+         "ref B", "opt B", "saved", "ref ms", "opt ms", "saved");
+  for (i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+    r.firstDiff = -1; // Left alone if the comparison couldn't run
+    same = kp347LinuxCompare(workloads[i].reference, workloads[i].optimized,
+                             BAUD, &r);
+    if (!same && (r.firstDiff < 0)) {
+      perror("kp347-compare");
+      return 1;
+    }
+    printf("%-18s ", workloads[i].name);
+    if (same)
+      printf("%-15s", "identical");
+    else
+      printf("differs at %-4ld", r.firstDiff);
+    printf(" %8lu %8lu %5.1f%% %10.1f %10.1f %5.1f%%\n", r.bytes[0],
+           r.bytes[1], saving(r.bytes[0], r.bytes[1]), r.time[0] / 1000.0,
+           r.time[1] / 1000.0, saving(r.time[0], r.time[1]));
+    if (same != workloads[i].same)
+      failed = 1;
+  }
+  return failed;
+}
@@ -0,0 +1,164 @@
+/*!
+ * @file kp347-faultbench.c
+ *
+ * Time to detect and time to recover from printer faults, and the paper
+ * they cost, for the three ways a host can drive a job:
+ *
+ *  - status: print the whole job, then check hasPaper(); on a fault wait
+ *    for it to clear and print the job again, once
+ *  - cancel: check hasPaper() after every part of the job; on a fault
+ *    reset(), wait for it to clear and print the job again
+ *  - resume: check after every part as well, but go on after the fault
+ *    from the first part not confirmed printed
+ *
+ * Each fault from the table below is scripted into the virtual printer
+ * and run once per path, in simulated time (kp347LinuxSimulateClock()),
+ * so the numbers are the same on every run and machine.  "detect" is
+ * from the fault to hasPaper() returning false, "report" from the fault
+ * to the printer's first reply showing it, "recover" from the fault
+ * clearing to the first row printed after it; "-" where it never came.
+ * "wasted" is paper used beyond a run without faults, negative if part
+ * of the job is missing, "lost" rows the job asked for while there was
+ * no paper.  Exits with 1 if the cancel or resume path missed a fault or
+ * a job didn't finish.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "kp347-virtual.h"
+
+#define BAUD 19200
+#define TEXT_LINES 4  // Text lines before and after the image
+#define BANDS 10      // Image bands, BAND_ROWS each
+#define BAND_ROWS 24
+#define PARTS (2 * TEXT_LINES + BANDS)
+#define FAULT_ROW 200 // Dot row the faults strike at, inside the image
+#define JOB_LIMIT 120000000UL // A job taking longer has failed, in us
+
+enum paths { PATH_STATUS, PATH_CANCEL, PATH_RESUME, PATHS };
+
+static const char *const pathNames[PATHS] = {"status", "cancel", "resume"};
+
+static const struct {
+  const char *name;
+  struct virtualFaults faults;
+} scenarios[] = {
+    {"paper-out", {.paperOutRow = FAULT_ROW, .reloadTime = 3000000UL}},
+    {"paper-out, slow replies",
+     {.paperOutRow = FAULT_ROW, .reloadTime = 3000000UL,
+      .statusDelay = 300000UL}},
+    {"paper-out, cold head",
+     {.paperOutRow = FAULT_ROW, .reloadTime = 3000000UL, .slowPercent = 30}},
+    {"cover open", {.coverOpenRow = FAULT_ROW, .coverOpenTime = 2000000UL}},
+};
+
+static uint8_t image[BANDS * BAND_ROWS * 48];
+static struct virtualPrinter *vp;
+
+static void printPart(int part) {
+  char line[32];
+
+  if ((part < TEXT_LINES) || (part >= TEXT_LINES + BANDS)) {
+    snprintf(line, sizeof(line), "Part %02d of the test job", part);
+    println(line);
+  } else {
+    printBitmapFromBitMap(384, BAND_ROWS,
+                          image + (part - TEXT_LINES) * BAND_ROWS * 48, false);
+  }
+}
+
+// Waits until the library and the printer are both done
+static void finish() {
+  timeoutWait();
+  kp347LinuxFlush();
+  while (virtualBusy(vp))
+    kp347LinuxYield();
+}
+
+// Prints the time from from to to in milliseconds, or "-" if to is 0
+static void printTime(int width, unsigned long from, unsigned long to) {
+  if (to)
+    printf(" %*.1f", width, (long)(to - from) / 1000.0);
+  else
+    printf(" %*s", width, "-");
+}
+
+static unsigned long rowsUsed() {
+  return vp->stats.rowsPrinted + vp->stats.rowsFed;
+}
+
+// Runs the job along path; returns when it was found faulty, 0 if never
+static unsigned long runJob(int path) {
+  unsigned long detected = 0, start = micros();
+  int part = 0, confirmed = 0; // Parts confirmed printed
+
+  while ((part < PARTS) && (micros() - start < JOB_LIMIT)) {
+    printPart(part++);
+    if ((path == PATH_STATUS) && (part < PARTS))
+      continue;
+    if (hasPaper()) {
+      confirmed = part;
+      continue;
+    }
+    if (detected && (path == PATH_STATUS))
+      break; // Printed twice; give up
+    if (!detected)
+      detected = micros();
+    if (path == PATH_CANCEL)
+      reset();
+    while (!hasPaper() && (micros() - start < JOB_LIMIT))
+      delay(100);
+    part = (path == PATH_RESUME) ? confirmed : 0;
+  }
+  finish();
+  return detected;
+}
+
+int main() {
+  unsigned long clean, detected, base, start;
+  const struct virtualStats *s;
+  int i, path, failed = 0;
+
+  for (i = 0; i < (int)sizeof(image); i++)
+    image[i] = (i * 7) ^ (i / 48);
+  kp347LinuxSimulateClock(true);
+  vp = kp347LinuxVirtual();
+  if (!vp) {
+    fprintf(stderr, "kp347-faultbench: built without KP347_VIRTUAL\n");
+    return 1;
+  }
+
+  kp347LinuxOpen("virtual", BAUD);
+  begin(268);
+  base = rowsUsed();
+  runJob(PATH_STATUS);
+  clean = rowsUsed() - base;
+  kp347LinuxClose();
+
+  printf("%-24s %-6s %9s %9s %10s %9s %6s %5s\n", "fault", "path",
+         "detect ms", "report ms", "recover ms", "job ms", "wasted", "lost");
+  for (i = 0; i < (int)(sizeof(scenarios) / sizeof(scenarios[0])); i++) {
+    for (path = 0; path < PATHS; path++) {
+      vp->faults = scenarios[i].faults;
+      kp347LinuxOpen("virtual", BAUD);
+      begin(268);
+      base = rowsUsed();
+      start = micros();
+      detected = runJob(path);
+      s = &vp->stats;
+      printf("%-24s %-6s", scenarios[i].name, pathNames[path]);
+      printTime(9, s->faultTime, detected);
+      printTime(9, s->faultTime, s->reportTime);
+      printTime(10, s->clearTime, s->printAgainTime);
+      printTime(9, start, micros());
+      printf(" %6ld %5lu\n", (long)(rowsUsed() - base - clean), s->rowsLost);
+      if ((!detected && (path != PATH_STATUS)) ||
+          (micros() - start >= JOB_LIMIT))
+        failed = 1;
+      kp347LinuxClose();
+      vp->faults = (struct virtualFaults){0};
+    }
+  }
+  return failed;
+}
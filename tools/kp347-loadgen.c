@@ -0,0 +1,387 @@
+/*!
+ * @file kp347-loadgen.c
+ *
+ * Load generator and soak harness for a host driving several printers.
+ * Jobs from a mix of receipts, kitchen tickets, logo receipts and labels
+ * arrive as a Poisson process, at a base rate with a lunch rush (rush
+ * times the rate) over the middle fifth of the run.  Each job is encoded
+ * on arrival with captureBegin() and queued for one of N virtual
+ * printers, chosen at random; each printer works through its queue one
+ * job at a time through the fan-out engine (kp347-fanout.h).
+ *
+ * Reported: end-to-end latency (arrival to the job printed) as p50, p99
+ * and p999, queue depth over time, CPU time per job (encoding alone and
+ * in all) and the memory high-water marks.  Time is simulated
+ * (kp347LinuxSimulateClock()) unless -R is given, so an hour of traffic
+ * takes seconds and all but the CPU and memory figures are the same on
+ * every run.  -W runs micros() at 32 bits, as on the MCU, starting just
+ * short of the wrap, so a soak crosses it.  Exits with 1 if a printer's
+ * input buffer overflowed or a job was still queued when the run ended.
+ *
+ *   kp347-loadgen [-n printers] [-r jobs/s] [-x rush] [-d seconds]
+ *                 [-i sample seconds] [-b baud] [-s seed] [-W] [-R]
+ */
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "kp347-fanout.h"
+#include "kp347-virtual.h"
+
+#define JOB_MAX 32768       // Largest encoded job, in bytes
+#define LATENCY_BUCKETS 600000 // 1 ms each; later ones count in the last
+#define DRAIN_LIMIT 3600    // Longest the queues may take to drain, in s
+#define WRAP_LEAD 30000000UL // -W starts this long before the wrap, in us
+
+// The library's built-in timing; the printers and the encoder share it
+static const struct printerProfile profile = {
+    268, 30000, 2100, 96, 500000L, false, {0, 0, 0, 0}, 0};
+
+struct job {
+  struct job *next;
+  unsigned long arrival; // micros()
+  size_t size;
+  uint8_t data[]; // Captured job
+};
+
+struct printer {
+  struct fanoutPrinter fan;
+  struct virtualPrinter *vp;
+  struct job *head, *tail; // Queue; head is printing while fan is busy
+  unsigned queued;
+};
+
+static struct printer *printers;
+static unsigned printerCount = 8;
+static uint32_t latency[LATENCY_BUCKETS];
+static unsigned long jobsIn, jobsDone;
+static size_t queuedBytes, queuedBytesPeak;
+static uint64_t random64 = 1;
+static uint8_t logo[48 * 80];
+
+// xorshift64*, uniform in (0, 1]
+static double uniform() {
+  random64 ^= random64 >> 12;
+  random64 ^= random64 << 25;
+  random64 ^= random64 >> 27;
+  return ((random64 * 2685821657736338717ULL) >> 11) / 9007199254740992.0 +
+         1.0 / 9007199254740992.0;
+}
+
+static double cpuSeconds() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void receipt(unsigned lines, bool withLogo) {
+  char line[40];
+  unsigned i;
+
+  if (withLogo)
+    printBitmapFromBitMap(384, 80, logo, false);
+  justify('C');
+  boldOn();
+  println("KP347 DINER");
+  boldOff();
+  justify('L');
+  for (i = 0; i < lines; i++) {
+    snprintf(line, sizeof(line), "%2u x Item %-14u %6u.%02u", i % 3 + 1,
+             (unsigned)(uniform() * 1000), (unsigned)(uniform() * 40),
+             (unsigned)(uniform() * 100));
+    println(line);
+  }
+  boldOn();
+  println("TOTAL                       42.00");
+  boldOff();
+  printBarcode("123456789012", EAN13);
+  feed(2);
+  cut(false);
+}
+
+static void kitchenTicket() {
+  char line[24];
+  unsigned i, n = 3 + (unsigned)(uniform() * 6);
+
+  doubleHeightOn();
+  println("TABLE 12");
+  for (i = 0; i < n; i++) {
+    snprintf(line, sizeof(line), "%u x Dish %u", i % 2 + 1,
+             (unsigned)(uniform() * 99));
+    println(line);
+  }
+  doubleHeightOff();
+  feed(2);
+  cut(true);
+}
+
+static void label() {
+  setSize('S');
+  println("Pick-up order");
+  println("Name: A. Customer");
+  println("Ready at 12:30");
+  feed(1);
+}
+
+// Encodes a job from the mix; returns NULL if it didn't fit
+static struct job *encode() {
+  static uint8_t buf[JOB_MAX];
+  double pick = uniform();
+  struct job *j;
+  size_t size;
+
+  captureBegin(buf, sizeof(buf));
+  if (pick < 0.5)
+    receipt(8 + (unsigned)(uniform() * 12), false);
+  else if (pick < 0.8)
+    kitchenTicket();
+  else if (pick < 0.95)
+    receipt(6, true);
+  else
+    label();
+  size = captureEnd();
+  if (!size || !(j = malloc(sizeof(*j) + size)))
+    return NULL;
+  memcpy(j->data, buf, size);
+  j->size = size;
+  j->next = NULL;
+  return j;
+}
+
+static void enqueue(struct printer *p, struct job *j) {
+  if (p->tail)
+    p->tail->next = j;
+  else
+    p->head = j;
+  p->tail = j;
+  p->queued++;
+  queuedBytes += j->size;
+  if (queuedBytesPeak < queuedBytes)
+    queuedBytesPeak = queuedBytes;
+}
+
+// Retires a printed job and starts the next one once the printer is done
+static void advance(struct printer *p, unsigned long now) {
+  struct job *j = p->head;
+  long t;
+
+  if (j && (p->fan.state == FANOUT_DONE)) {
+    if (KP347_TIME_DIFF(p->fan.doneTime, now) > 0)
+      return; // Still printing
+    t = KP347_TIME_DIFF(p->fan.doneTime, j->arrival) / 1000;
+    latency[(t < LATENCY_BUCKETS) ? t : LATENCY_BUCKETS - 1]++;
+    jobsDone++;
+    queuedBytes -= j->size;
+    p->head = j->next;
+    if (!p->head)
+      p->tail = NULL;
+    p->queued--;
+    free(j);
+    p->fan.state = FANOUT_IDLE;
+  }
+  if (p->head && (p->fan.state == FANOUT_IDLE))
+    fanoutStart(&p->fan, 1, p->head->data, p->head->size);
+}
+
+static double percentile(double q) {
+  unsigned long want = (unsigned long)ceil(q * jobsDone), seen = 0;
+  unsigned long i;
+
+  for (i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += latency[i];
+    if (seen >= want)
+      return i;
+  }
+  return LATENCY_BUCKETS;
+}
+
+int main(int argc, char **argv) {
+  double rate = 0.25, rush = 2.5, encodeCpu = 0, cpu, t;
+  unsigned long duration = 600, interval = 60, baud = 19200, now, last,
+                nextArrival, nextSample, overflowed = 0;
+  unsigned long long elapsed = 0, end, limit; // Simulated run time, in us
+  bool wrap = false, realTime = false, busy;
+  struct rusage ru;
+  struct printer *p;
+  unsigned i, queued, maxQueue;
+  int c;
+  long ahead, step;
+
+  while ((c = getopt(argc, argv, "n:r:x:d:i:b:s:WR")) != -1) {
+    switch (c) {
+    case 'n':
+      printerCount = strtoul(optarg, NULL, 0);
+      break;
+    case 'r':
+      rate = strtod(optarg, NULL);
+      break;
+    case 'x':
+      rush = strtod(optarg, NULL);
+      break;
+    case 'd':
+      duration = strtoul(optarg, NULL, 0);
+      break;
+    case 'i':
+      interval = strtoul(optarg, NULL, 0);
+      break;
+    case 'b':
+      baud = strtoul(optarg, NULL, 0);
+      break;
+    case 's':
+      random64 = strtoull(optarg, NULL, 0);
+      break;
+    case 'W':
+      wrap = true;
+      break;
+    case 'R':
+      realTime = true;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n printers] [-r jobs/s] [-x rush] "
+                      "[-d seconds] [-i sample seconds] [-b baud] "
+                      "[-s seed] [-W] [-R]\n",
+              argv[0]);
+      return 2;
+    }
+  }
+  if (!printerCount || (printerCount > 255) || (rate <= 0) || !interval ||
+      !baud || !random64) {
+    fprintf(stderr, "%s: bad option value\n", argv[0]);
+    return 2;
+  }
+
+  for (i = 0; i < sizeof(logo); i++)
+    logo[i] = (i % 48 < 24) ? 0xF0 : 0x0F;
+  kp347LinuxSimulateClock(!realTime);
+  kp347LinuxWrapClock(wrap);
+  if (wrap)
+    kp347LinuxSetMicros(0xFFFFFFFFUL - WRAP_LEAD);
+  kp347LinuxOpen("null", baud); // The library only encodes
+  begin(profile.firmware);
+  setProfile(&profile);
+
+  printers = calloc(printerCount, sizeof(*printers));
+  for (i = 0; printers && (i < printerCount); i++) {
+    p = &printers[i];
+    if (!(p->vp = calloc(1, sizeof(*p->vp))))
+      break;
+    virtualBegin(p->vp, &profile, (11000000UL + baud / 2) / baud);
+    p->fan.profile = &profile;
+    p->fan.byteTime = p->vp->byteTime;
+    p->fan.send = virtualSend;
+    p->fan.context = p->vp;
+  }
+  if (!printers || (i < printerCount)) {
+    fprintf(stderr, "%s: out of memory\n", argv[0]);
+    return 1;
+  }
+
+  printf("kp347-loadgen: %u printers at %lu baud, %.2f jobs/s (x%.1f rush), "
+         "%lu s, seed %llu%s\n",
+         printerCount, baud, rate, rush, duration,
+         (unsigned long long)random64, wrap ? ", 32-bit clock" : "");
+  printf("%8s %8s %8s %10s\n", "time s", "queued", "busy", "max queue");
+
+  end = duration * 1000000ULL;
+  limit = end + DRAIN_LIMIT * 1000000ULL;
+  last = now = micros();
+  nextArrival = now + (unsigned long)(-log(uniform()) / rate * 1e6);
+  nextSample = now + interval * 1000000UL;
+  while (elapsed < limit) {
+    // Arrivals due, until the end of the run
+    while ((elapsed < end) && (KP347_TIME_DIFF(nextArrival, now) <= 0)) {
+      struct job *j;
+
+      t = cpuSeconds();
+      j = encode();
+      encodeCpu += cpuSeconds() - t;
+      if (!j) {
+        fprintf(stderr, "%s: job too large or out of memory\n", argv[0]);
+        return 1;
+      }
+      j->arrival = nextArrival;
+      enqueue(&printers[(unsigned)(uniform() * printerCount) % printerCount],
+              j);
+      jobsIn++;
+      t = (elapsed > end * 2 / 5) && (elapsed < end * 3 / 5) ? rate * rush
+                                                             : rate;
+      nextArrival += (unsigned long)(-log(uniform()) / t * 1e6) + 1;
+    }
+
+    busy = false;
+    for (i = 0; i < printerCount; i++) {
+      advance(&printers[i], now);
+      if (printers[i].head)
+        busy = true;
+    }
+    for (i = 0; i < printerCount; i++)
+      fanoutPump(&printers[i].fan, 1);
+
+    if (KP347_TIME_DIFF(nextSample, now) <= 0) {
+      for (i = queued = maxQueue = 0; i < printerCount; i++) {
+        queued += printers[i].queued;
+        if (maxQueue < printers[i].queued)
+          maxQueue = printers[i].queued;
+      }
+      for (c = i = 0; i < printerCount; i++)
+        c += printers[i].head != NULL;
+      printf("%8llu %8u %8d %10u\n", elapsed / 1000000ULL, queued, c,
+             maxQueue);
+      nextSample += interval * 1000000UL;
+    }
+    if ((elapsed >= end) && !busy)
+      break;
+
+    // On to the next event: an arrival, a sample or a printer's deadline
+    ahead = KP347_TIME_DIFF(nextSample, now);
+    if ((elapsed < end) && (KP347_TIME_DIFF(nextArrival, now) < ahead))
+      ahead = KP347_TIME_DIFF(nextArrival, now);
+    for (i = 0; i < printerCount; i++) {
+      p = &printers[i];
+      if (p->fan.state == FANOUT_BUSY)
+        step = KP347_TIME_DIFF(p->fan.resumeTime, now);
+      else if (p->head && (p->fan.state == FANOUT_DONE))
+        step = KP347_TIME_DIFF(p->fan.doneTime, now);
+      else
+        continue;
+      if (step < ahead)
+        ahead = step;
+    }
+    if (ahead > 0) {
+      if (realTime)
+        kp347LinuxYield();
+      else
+        kp347LinuxSetMicros(now + ahead);
+    }
+    now = micros();
+    elapsed += (uint32_t)(now - last);
+    last = now;
+  }
+
+  for (i = 0; i < printerCount; i++) {
+    while (virtualBusy(printers[i].vp))
+      kp347LinuxSetMicros(micros() + 1000);
+    overflowed += printers[i].vp->stats.bytesOverflowed;
+  }
+  cpu = cpuSeconds();
+  getrusage(RUSAGE_SELF, &ru);
+
+  printf("jobs %lu, done %lu, overflowed bytes %lu\n", jobsIn, jobsDone,
+         overflowed);
+  if (jobsDone)
+    printf("latency ms: p50 %.0f, p99 %.0f, p999 %.0f\n", percentile(0.5),
+           percentile(0.99), percentile(0.999));
+  // Machine-dependent from here on
+  printf("cpu us/job: encode %.1f, total %.1f\n",
+         jobsIn ? encodeCpu * 1e6 / jobsIn : 0.0,
+         jobsDone ? cpu * 1e6 / jobsDone : 0.0);
+  printf("memory high-water: rss %ld KiB, queued jobs %zu bytes\n",
+         ru.ru_maxrss, queuedBytesPeak);
+  return (overflowed || (jobsDone < jobsIn)) ? 1 : 0;
+}
@@ -0,0 +1,537 @@
+/*!
+ * @file kp347-microbench.c
+ *
+ * Host CPU cost of the library's encoding, call by call, on the null link
+ * (kp347LinuxOpen("null")): bytes are counted and dropped, and every wait
+ * for the printer is skipped, so the printer's physical timing can't hide
+ * a change to the encoder.
+ *
+ * Each case runs one operation of the kp347-printer.h API, in batches
+ * sized to take about BATCH_NS; the best of BATCHES batches is reported,
+ * per operation and per unit of work (a byte for write(), a row for
+ * bitmaps, a barcode for printBarcode(), ...):
+ *
+ *   case  unit  ns/op  instr/op  cycles/op  bytes/op  ns/unit  instr/unit
+ *
+ * instr counts user-space instructions through perf_event_open() and is
+ * "-" where the kernel doesn't allow it; cycles is the port's cycle
+ * counter (kp347LinuxCycles()).  Cases are always listed in the same order
+ * with the same columns, so two runs compare line by line; bytes/op
+ * depends only on the encoder.  -q runs one short batch per case, as a
+ * smoke test.  Names given on the command line select the cases whose
+ * name starts with one of them.
+ *
+ *   kp347-microbench [-q] [case...]
+ */
+
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kp347-printer.h"
+
+#define BATCH_NS 2000000.0 // Target time of a batch
+#define BATCHES 5          // Batches per case; the best one is reported
+#define BAUD 19200
+
+static const struct printerProfile profile = {
+    268, 30000, 2100, 96, 500000L, false, {0, 0, 0, 0}, 0};
+
+static const char text[] = "The quick brown fox jumps over the lazy dog. "
+                           "0123456789";
+static uint8_t image[48 * 240]; // 384 x 240, row-major
+static uint8_t capture[8192];
+static int streamFd = -1;
+
+// Asset bundle with a 384 x 48 bitmap and a text template
+static union {
+  uint32_t align;
+  uint8_t data[sizeof(struct assetBundleHeader) + 4 * sizeof(struct assetEntry) +
+               2 * sizeof(uint16_t) + 28 + 48 * 48 + 32];
+} bundle;
+
+static void buildBundle() {
+  struct assetBundleHeader *hdr = (struct assetBundleHeader *)bundle.data;
+  struct assetEntry *dir = (struct assetEntry *)(hdr + 1);
+  uint16_t *index = (uint16_t *)(dir + 4);
+  uint32_t at = (uint8_t *)(index + 2) - bundle.data;
+  static const char *const names[2] = {"logo", "thanks"};
+  static const char thanks[] = "Thank you!\n";
+  struct assetEntry *e;
+  int i;
+
+  hdr->magic = ASSET_BUNDLE_MAGIC;
+  hdr->version = ASSET_BUNDLE_VERSION;
+  hdr->assetCount = 2;
+  hdr->slotCount = 4;
+  for (i = 0; i < 2; i++) {
+    e = &dir[assetHash(names[i]) & 3];
+    while (e->nameHash)
+      e = (e == &dir[3]) ? dir : e + 1;
+    e->nameHash = assetHash(names[i]);
+    e->nameOffset = at;
+    strcpy((char *)bundle.data + at, names[i]);
+    at = (at + strlen(names[i]) + 4) & ~3U;
+    e->dataOffset = at;
+    e->id = i;
+    index[i] = e - dir;
+    if (i == 0) {
+      e->type = ASSET_BITMAP;
+      e->width = 384;
+      e->height = 48;
+      e->dataSize = 48 * 48;
+      e->printRows = 48;
+      memcpy(bundle.data + at, image, e->dataSize);
+    } else {
+      e->type = ASSET_TEXT;
+      e->dataSize = sizeof(thanks) - 1;
+      e->feedRows = 30;
+      memcpy(bundle.data + at, thanks, e->dataSize);
+    }
+    at = (at + e->dataSize + 3) & ~3U;
+  }
+  hdr->size = at;
+}
+
+// Cases: one operation each
+
+static void opWrite() {
+  for (const char *s = text; *s; s++)
+    write(*s);
+}
+static void opPrintln() { println(text); }
+static void opTab() { tab(); }
+static void opFeed() { feed(1); }
+static void opFeedRows() { feedRows(24); }
+static void opFlush() { flush(); }
+// Style setters come in pairs, so a call never repeats the current mode
+static void opJustify() {
+  justify('C');
+  justify('L');
+}
+static void opSetSize() {
+  setSize('L');
+  setSize('S');
+}
+static void opSetFont() {
+  setFont('B');
+  setFont('A');
+}
+static void opBold() {
+  boldOn();
+  boldOff();
+}
+static void opDoubleHeight() {
+  doubleHeightOn();
+  doubleHeightOff();
+}
+static void opDoubleWidth() {
+  doubleWidthOn();
+  doubleWidthOff();
+}
+static void opInverse() {
+  inverseOn();
+  inverseOff();
+}
+static void opStrike() {
+  strikeOn();
+  strikeOff();
+}
+static void opUnderline() {
+  underlineOn(1);
+  underlineOff();
+}
+static void opUpsideDown() {
+  upsideDownOn();
+  upsideDownOff();
+}
+static void opCharSpacing() {
+  setCharSpacing(2);
+  setCharSpacing(0);
+}
+static void opLineHeight() {
+  setLineHeight(40);
+  setLineHeight(30);
+}
+static void opNormal() { normal(); }
+static void opSetDefault() { setDefault(); }
+static void opHeatConfig() { setHeatConfig(11, 120, 40); }
+static void opPrintDensity() { setPrintDensity(10, 2); }
+static void opSetTimes() { setTimes(30000, 2100); }
+static void opSetProfile() { setProfile(&profile); }
+static void opModeCost() { setModeCost(0, 100); }
+static void opMaxChunkHeight() { setMaxChunkHeight(255); }
+static void opOnline() {
+  offline();
+  online();
+}
+static void opReset() { reset(); }
+static void opBegin() { begin(268); }
+static void opTest() { test(); }
+static void opTestPage() { testPage(); }
+static void opTimeout() {
+  timeoutSet(1000);
+  timeoutWait();
+}
+static void opTimeoutRemaining() { (void)timeoutRemaining(); }
+static void opStatus() {
+  statusRequest();
+  (void)statusPoll();
+}
+static void opHasPaper() { (void)hasPaper(); }
+static void opBitmap() { printBitmapFromBitMap(384, 240, image, false); }
+static void opBitmapSmall() { printBitmapFromBitMap(64, 24, image, false); }
+static void opBandHeight() { (void)bitmapBandHeight(384); }
+#if KP347_AUTODETECT
+static void opDetectFirmware() { (void)detectFirmware(); }
+#endif
+#if KP347_CUTTER
+static void opCut() { cut(false); }
+static void opSetCutTime() { setCutTime(500000L); }
+static void opMeasureCutTime() { (void)measureCutTime(true); }
+static void opPrintCopies() { printCopies(2, opPrintln, true); }
+#endif
+#if KP347_BARCODE
+static void opBarcodeHeight() { setBarcodeHeight(60); }
+static void opEan13() { printBarcode("123456789012", EAN13); }
+static void opCode128() { printBarcode("{BKP347-0001", CODE128); }
+#endif
+#if KP347_COLUMN_BITMAPS
+static void opBitmapColumns() { printBitmapColumns(384, 240, image, false); }
+#endif
+#if KP347_BITMAP_STREAM
+static void opBitmapStream() {
+  lseek(streamFd, 4, SEEK_SET);
+  printBitmapFromStream(384, 240);
+}
+static void opBitmapStreamHeader() {
+  lseek(streamFd, 0, SEEK_SET);
+  printBitmap();
+}
+#endif
+#if KP347_DRAFT
+static void opDraftBitmap() {
+  setDraftMode(true);
+  printBitmapFromBitMap(384, 240, image, false);
+  setDraftMode(false);
+}
+#endif
+#if KP347_CHARSET
+static void opCharset() {
+  setCharset(1);
+  setCharset(0);
+}
+static void opCodePage() {
+  setCodePage(16);
+  setCodePage(0);
+}
+#endif
+#if KP347_SLEEP
+static void opSleep() {
+  sleep();
+  wake();
+}
+static void opSleepAfter() { sleepAfter(60); }
+#endif
+#if KP347_CYCLES
+static void opCycleCounts() { (void)cycleCounts(); }
+static void opCycleCountsReset() { cycleCountsReset(); }
+#endif
+#if KP347_STATS
+static void opStatsRead() {
+  struct printerStats s;
+
+  statsRead(&s);
+}
+static void opStatsReset() { statsReset(); }
+#endif
+#if KP347_TABLE
+static const struct tableColumn columns[3] = {
+    {4, 0, 'R', false}, {0, 60, 'L', true}, {0, 0, 'R', false}};
+static void opTable() {
+  static const char *const rows[4][3] = {
+      {"2", "Coffee", "5.00"},
+      {"1", "Blueberry muffin with extra crumble topping", "3.50"},
+      {"12", "Water", "0.00"},
+      {"1", "Tip", "2.00"}};
+
+  tableBegin(columns, 3);
+  for (int i = 0; i < 4; i++)
+    tableRow(rows[i]);
+}
+#endif
+#if KP347_ASSETS
+static void opAssetHash() { (void)assetHash("kitchen-logo"); }
+static void opAssetValid() { (void)assetBundleValid(bundle.data, sizeof(bundle.data)); }
+static void opAssetFind() { (void)assetFind(bundle.data, "thanks"); }
+static void opAssetFindId() { (void)assetFindId(bundle.data, 1); }
+static void opAssetPrintTime() {
+  (void)assetPrintTime(assetFindId(bundle.data, 0));
+}
+static void opPrintAssetBitmap() {
+  printAsset(bundle.data, assetFindId(bundle.data, 0));
+}
+static void opPrintAssetText() {
+  printAsset(bundle.data, assetFindId(bundle.data, 1));
+}
+#endif
+#if KP347_FANOUT
+static void opCapture() {
+  captureBegin(capture, sizeof(capture));
+  println(text);
+  (void)captureEnd();
+}
+#endif
+#if KP347_PROBE
+static void opProbeBuffer() {
+  struct bufferProbe result;
+
+  (void)probeBuffer(4096, &result, NULL);
+}
+static void opTuneProfile() {
+  struct printerProfile p = profile;
+
+  (void)tuneProfile(&p, 10);
+}
+#endif
+
+static const struct {
+  const char *name;
+  const char *unit;
+  unsigned units; // Units of work per operation
+  void (*op)(void);
+} cases[] = {
+    {"write", "byte", sizeof(text) - 1, opWrite},
+    {"println", "line", 1, opPrintln},
+    {"tab", "call", 1, opTab},
+    {"feed", "call", 1, opFeed},
+    {"feedRows", "call", 1, opFeedRows},
+    {"flush", "call", 1, opFlush},
+    {"justify", "call", 2, opJustify},
+    {"setSize", "call", 2, opSetSize},
+    {"setFont", "call", 2, opSetFont},
+    {"boldOn/Off", "call", 2, opBold},
+    {"doubleHeightOn/Off", "call", 2, opDoubleHeight},
+    {"doubleWidthOn/Off", "call", 2, opDoubleWidth},
+    {"inverseOn/Off", "call", 2, opInverse},
+    {"strikeOn/Off", "call", 2, opStrike},
+    {"underlineOn/Off", "call", 2, opUnderline},
+    {"upsideDownOn/Off", "call", 2, opUpsideDown},
+    {"setCharSpacing", "call", 2, opCharSpacing},
+    {"setLineHeight", "call", 2, opLineHeight},
+    {"normal", "call", 1, opNormal},
+    {"setDefault", "call", 1, opSetDefault},
+    {"setHeatConfig", "call", 1, opHeatConfig},
+    {"setPrintDensity", "call", 1, opPrintDensity},
+    {"setTimes", "call", 1, opSetTimes},
+    {"setProfile", "call", 1, opSetProfile},
+    {"setModeCost", "call", 1, opModeCost},
+    {"setMaxChunkHeight", "call", 1, opMaxChunkHeight},
+    {"offline/online", "call", 2, opOnline},
+    {"reset", "call", 1, opReset},
+    {"begin", "call", 1, opBegin},
+    {"test", "call", 1, opTest},
+    {"testPage", "call", 1, opTestPage},
+    {"timeoutSet/Wait", "call", 2, opTimeout},
+    {"timeoutRemaining", "call", 1, opTimeoutRemaining},
+    {"statusRequest/Poll", "call", 2, opStatus},
+    {"hasPaper", "call", 1, opHasPaper},
+    {"printBitmapFromBitMap", "row", 240, opBitmap},
+    {"printBitmapFromBitMap64", "row", 24, opBitmapSmall},
+    {"bitmapBandHeight", "call", 1, opBandHeight},
+#if KP347_AUTODETECT
+    {"detectFirmware", "call", 1, opDetectFirmware},
+#endif
+#if KP347_CUTTER
+    {"cut", "cut", 1, opCut},
+    {"setCutTime", "call", 1, opSetCutTime},
+    {"measureCutTime", "call", 1, opMeasureCutTime},
+    {"printCopies", "copy", 2, opPrintCopies},
+#endif
+#if KP347_BARCODE
+    {"setBarcodeHeight", "call", 1, opBarcodeHeight},
+    {"printBarcode-EAN13", "barcode", 1, opEan13},
+    {"printBarcode-CODE128", "barcode", 1, opCode128},
+#endif
+#if KP347_COLUMN_BITMAPS
+    {"printBitmapColumns", "row", 240, opBitmapColumns},
+#endif
+#if KP347_BITMAP_STREAM
+    {"printBitmapFromStream", "row", 240, opBitmapStream},
+    {"printBitmap", "row", 240, opBitmapStreamHeader},
+#endif
+#if KP347_DRAFT
+    {"setDraftMode-bitmap", "row", 240, opDraftBitmap},
+#endif
+#if KP347_CHARSET
+    {"setCharset", "call", 2, opCharset},
+    {"setCodePage", "call", 2, opCodePage},
+#endif
+#if KP347_SLEEP
+    {"sleep/wake", "call", 2, opSleep},
+    {"sleepAfter", "call", 1, opSleepAfter},
+#endif
+#if KP347_CYCLES
+    {"cycleCounts", "call", 1, opCycleCounts},
+    {"cycleCountsReset", "call", 1, opCycleCountsReset},
+#endif
+#if KP347_STATS
+    {"statsRead", "call", 1, opStatsRead},
+    {"statsReset", "call", 1, opStatsReset},
+#endif
+#if KP347_TABLE
+    {"tableBegin/Row", "row", 4, opTable},
+#endif
+#if KP347_ASSETS
+    {"assetHash", "call", 1, opAssetHash},
+    {"assetBundleValid", "call", 1, opAssetValid},
+    {"assetFind", "call", 1, opAssetFind},
+    {"assetFindId", "call", 1, opAssetFindId},
+    {"assetPrintTime", "call", 1, opAssetPrintTime},
+    {"printAsset-bitmap", "row", 48, opPrintAssetBitmap},
+    {"printAsset-text", "call", 1, opPrintAssetText},
+#endif
+#if KP347_FANOUT
+    {"captureBegin/End", "line", 1, opCapture},
+#endif
+#if KP347_PROBE
+    {"probeBuffer", "call", 1, opProbeBuffer},
+    {"tuneProfile", "call", 1, opTuneProfile},
+#endif
+};
+
+// User-space instruction counter, or -1 where there is none
+static int instructionCounter() {
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t readCounter(int fd) {
+  uint64_t n = 0;
+
+  if ((fd < 0) || (read(fd, &n, sizeof(n)) != sizeof(n)))
+    return 0;
+  return n;
+}
+
+static double nanoseconds() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static bool selected(const char *name, int argc, char **argv) {
+  if (argc <= 0)
+    return true;
+  for (int i = 0; i < argc; i++) {
+    if (!strncmp(name, argv[i], strlen(argv[i])))
+      return true;
+  }
+  return false;
+}
+
+int main(int argc, char **argv) {
+  double ns, best, bestInstr, bestCycles, bytes;
+  unsigned long n, i, sent, cycles;
+  uint64_t instr;
+  bool quick = false;
+  int counter, c, batch, batches;
+  FILE *stream;
+
+  while ((c = getopt(argc, argv, "q")) != -1) {
+    if (c != 'q') {
+      fprintf(stderr, "usage: %s [-q] [case...]\n", argv[0]);
+      return 2;
+    }
+    quick = true;
+  }
+  batches = quick ? 1 : BATCHES;
+
+  for (i = 0; i < sizeof(image); i++)
+    image[i] = ((i / 48) % 24 < 12) ? (uint8_t)(i * 37) : 0x00;
+  buildBundle();
+  if (!assetBundleValid(bundle.data, sizeof(bundle.data))) {
+    fprintf(stderr, "kp347-microbench: bad test bundle\n");
+    return 1;
+  }
+  // Stream cases read a width and height, then the image
+  stream = tmpfile();
+  if (!stream || (fwrite("\x80\x01\xf0\x00", 1, 4, stream) != 4) ||
+      (fwrite(image, 1, sizeof(image), stream) != sizeof(image)) ||
+      fflush(stream)) {
+    fprintf(stderr, "kp347-microbench: can't write the stream file\n");
+    return 1;
+  }
+  streamFd = fileno(stream);
+  kp347LinuxSetStream(streamFd, -1);
+  if (kp347LinuxOpen("null", BAUD) < 0) {
+    fprintf(stderr, "kp347-microbench: can't open the null link\n");
+    return 1;
+  }
+  begin(268);
+  setProfile(&profile);
+  counter = instructionCounter();
+
+  printf("%-24s %-7s %10s %10s %10s %9s %10s %10s\n", "case", "unit", "ns/op",
+         "instr/op", "cycles/op", "bytes/op", "ns/unit", "instr/unit");
+  for (c = 0; c < (int)(sizeof(cases) / sizeof(cases[0])); c++) {
+    if (!selected(cases[c].name, argc - optind, argv + optind))
+      continue;
+
+    // Warm up, and size the batches from a first timing
+    ns = nanoseconds();
+    sent = kp347LinuxBytesSent();
+    cases[c].op();
+    kp347LinuxFlush();
+    ns = nanoseconds() - ns;
+    bytes = kp347LinuxBytesSent() - sent;
+    n = quick ? 1 : (ns < BATCH_NS) ? (unsigned long)(BATCH_NS / (ns + 1)) : 1;
+
+    best = bestInstr = bestCycles = 0;
+    for (batch = 0; batch < batches; batch++) {
+      sent = kp347LinuxBytesSent();
+      instr = readCounter(counter);
+      cycles = kp347LinuxCycles();
+      ns = nanoseconds();
+      for (i = 0; i < n; i++)
+        cases[c].op();
+      kp347LinuxFlush();
+      ns = (nanoseconds() - ns) / n;
+      cycles = kp347LinuxCycles() - cycles;
+      instr = readCounter(counter) - instr;
+      bytes = (double)(kp347LinuxBytesSent() - sent) / n;
+      if (!batch || (ns < best))
+        best = ns;
+      if (!batch || ((double)cycles / n < bestCycles))
+        bestCycles = (double)cycles / n;
+      if (!batch || ((double)instr / n < bestInstr))
+        bestInstr = (double)instr / n;
+    }
+
+    printf("%-24s %-7s %10.1f", cases[c].name, cases[c].unit, best);
+    if (counter >= 0)
+      printf(" %10.0f", bestInstr);
+    else
+      printf(" %10s", "-");
+    printf(" %10.0f %9.0f %10.2f", bestCycles, bytes,
+           best / cases[c].units);
+    if (counter >= 0)
+      printf(" %10.1f\n", bestInstr / cases[c].units);
+    else
+      printf(" %10s\n", "-");
+  }
+  kp347LinuxClose();
+  return 0;
+}
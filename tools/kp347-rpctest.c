@@ -0,0 +1,166 @@
+/*!
+ * @file kp347-rpctest.c
+ *
+ * Tests of the host protocol (kp347-rpc.h), run on the null link with
+ * the host stream on a pair of pipes.  Each test prints its name and
+ * "ok" or what went wrong; exits with 1 if any failed.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kp347-rpc.h"
+
+#define IMAGE_W 384
+#define CHUNK_ROWS 8                        // Rows per image chunk
+#define CHUNK_BYTES (CHUNK_ROWS * IMAGE_W / 8)
+#define CHUNKS 12
+#define LOST_CHUNK 3 // Chunk the link loses on its first send
+#define HOST_AHEAD 4 // Chunks the host sends past the one still missing
+
+static int toMcu[2], fromMcu[2]; // Pipes, read end first
+static uint8_t seq;
+static uint8_t image[CHUNKS * CHUNK_BYTES];
+static int failed;
+
+// Sends one request frame, unless lose is set, and runs the MCU side.
+// Returns the reply payload length, or -1 if there was no reply.
+static int call(const uint8_t *payload, uint16_t len, bool lose,
+                uint8_t *reply, uint16_t size) {
+  uint8_t frame[RPC_MAX_PAYLOAD + 6], head[4], crc[2];
+  uint16_t c = 0xFFFF, n = 0, i, rlen;
+
+  frame[n++] = RPC_SYNC;
+  frame[n++] = ++seq;
+  frame[n++] = len;
+  frame[n++] = len >> 8;
+  for (i = 1; i < n; i++)
+    c = rpcCrc(c, frame[i]);
+  for (i = 0; i < len; i++) {
+    frame[n++] = payload[i];
+    c = rpcCrc(c, payload[i]);
+  }
+  frame[n++] = c;
+  frame[n++] = c >> 8;
+  if (lose)
+    return -1;
+  if ((write)(toMcu[1], frame, n) != n) // The C library's, not the printer's
+    return -1;
+  rpcPoll();
+  if ((read(fromMcu[0], head, 4) != 4) || (head[0] != RPC_SYNC) ||
+      (head[1] != seq))
+    return -1;
+  rlen = head[2] | (head[3] << 8);
+  if ((rlen > size) || (read(fromMcu[0], reply, rlen) != rlen) ||
+      (read(fromMcu[0], crc, 2) != 2))
+    return -1;
+  return rlen;
+}
+
+static void check(const char *name, bool ok) {
+  printf("%-40s %s\n", name, ok ? "ok" : "FAILED");
+  if (!ok)
+    failed = 1;
+}
+
+// Sends the image in chunks like a pipelining host: up to HOST_AHEAD
+// chunks past the next one the printer needs, resending that one only
+// once it may send no further.  lost is the chunk the link drops on its
+// first send, or -1.  Counts the sends of each chunk; returns false if the
+// transfer didn't finish.
+static bool sendImage(int lost, unsigned *sends) {
+  uint8_t req[8 + CHUNK_BYTES], reply[16];
+  uint16_t next = 0, c = 0, send;
+  int n, guard;
+
+  req[0] = RPC_IMAGE_BEGIN;
+  req[1] = IMAGE_W & 0xFF;
+  req[2] = IMAGE_W >> 8;
+  req[3] = (CHUNKS * CHUNK_ROWS) & 0xFF;
+  req[4] = (CHUNKS * CHUNK_ROWS) >> 8;
+  req[5] = 0;
+  if ((call(req, 6, false, reply, sizeof(reply)) != 4) || reply[0])
+    return false;
+
+  for (guard = 0; (next < CHUNKS) && (guard < 4 * CHUNKS); guard++) {
+    if ((c < CHUNKS) && (c <= next + HOST_AHEAD))
+      send = c++; // New chunk
+    else
+      send = next; // Nothing more to send ahead: resend what's missing
+    sends[send]++;
+    req[0] = RPC_IMAGE_CHUNK;
+    req[1] = send;
+    req[2] = send >> 8;
+    req[3] = CHUNK_BYTES & 0xFF;
+    req[4] = CHUNK_BYTES >> 8;
+    memcpy(req + 5, image + send * CHUNK_BYTES, CHUNK_BYTES);
+    n = call(req, 5 + CHUNK_BYTES, (send == lost) && (sends[send] == 1),
+             reply, sizeof(reply));
+    if (n < 0)
+      continue; // Lost; the window catches it
+    if ((n != 5) || reply[0])
+      return false;
+    next = reply[2] | (reply[3] << 8);
+  }
+  return next == CHUNKS;
+}
+
+static void testSelectiveResend() {
+  unsigned sends[CHUNKS] = {0}, clean[CHUNKS] = {0}, i, others = 0;
+  unsigned long bytes, cleanBytes;
+  bool ok;
+
+  bytes = kp347LinuxBytesSent();
+  ok = sendImage(-1, clean);
+  cleanBytes = kp347LinuxBytesSent() - bytes;
+  bytes = kp347LinuxBytesSent();
+  ok = ok && sendImage(LOST_CHUNK, sends);
+  bytes = kp347LinuxBytesSent() - bytes;
+  for (i = 0; i < CHUNKS; i++) {
+    if ((i != LOST_CHUNK) && (sends[i] != 1))
+      others++;
+  }
+  check("image: lost chunk resent, and only it",
+        ok && (sends[LOST_CHUNK] == 2) && !others);
+  check("image: printed as without the loss", ok && (bytes == cleanBytes));
+}
+
+// A frame of count NOPs; returns the status and sets *calls
+static int nops(uint16_t count, uint8_t *calls) {
+  uint8_t req[RPC_MAX_PAYLOAD] = {0}, reply[16];
+
+  if (call(req, count, false, reply, sizeof(reply)) != 2)
+    return -1;
+  *calls = reply[1];
+  return reply[0];
+}
+
+static void testBatchCount() {
+  uint8_t calls = 0;
+  bool ok;
+
+  ok = (nops(RPC_MAX_CALLS, &calls) == RPC_OK) && (calls == RPC_MAX_CALLS);
+  check("batch: RPC_MAX_CALLS calls run", ok);
+  ok = (nops(RPC_MAX_PAYLOAD, &calls) == RPC_ERR_ARGS) &&
+       (calls == RPC_MAX_CALLS);
+  check("batch: the count never wraps", ok);
+}
+
+int main() {
+  unsigned i;
+
+  for (i = 0; i < sizeof(image); i++)
+    image[i] = (uint8_t)(i * 13 + i / 48);
+  if (pipe(toMcu) || pipe(fromMcu)) {
+    perror("kp347-rpctest");
+    return 1;
+  }
+  kp347LinuxSetStream(toMcu[0], fromMcu[1]);
+  kp347LinuxOpen("null", 19200);
+  begin(268);
+
+  testSelectiveResend();
+  testBatchCount();
+  return failed;
+}